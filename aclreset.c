@@ -0,0 +1,657 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	aclreset.c
+
+	Built-in recursive ownership and ACL reset
+
+	Replaces "takeown /r" and "icacls /t" on large protected trees. The tree is
+	walked by a pool of worker threads impersonating the TrustedInstaller token.
+	Each directory is a task: it is enumerated with large-buffer batches, the
+	owner/DACL of its entries are set, and its subdirectories become new tasks.
+	Every worker has its own deque of tasks: it takes the newest one of its own
+	deque (depth first, warm caches) and steals the oldest one of another deque
+	when its own is empty (breadth first, big subtrees).
+
+	In reset mode, the DACL of every object is rebuilt from the inheritable ACEs
+	of its parent, as "icacls /reset" does. All the files of a directory inherit
+	the same DACL (and all its subdirectories too), so it is computed only twice
+	per directory, not once per object. The exception is a parent with CREATOR
+	OWNER or CREATOR GROUP ACEs: the inherited DACL then depends on the owner of
+	each object, so it is computed per object (unless the owner verb gives the
+	same owner to all of them). A root that is not walked (a file, a junction
+	or a symbolic link) gets the DACL inherited from its own parent.
+
+*/
+
+#include <windows.h>
+#include <aclapi.h>
+#include <sddl.h>
+#include <stdlib.h>
+
+#include "utils.h" // Utility functions
+
+// Directory to process
+typedef struct {
+	PSECURITY_DESCRIPTOR pSD;  // Security descriptor of the directory (reset mode)
+	size_t nPathLen;
+	wchar_t wszPath[];  // Followed by the security descriptor
+} TASK;
+
+// Tasks of a worker. The owner pushes and takes at the tail, thieves take at
+// the head.
+typedef struct {
+	CRITICAL_SECTION lock;
+	TASK** ppTasks;
+	size_t nHead, nTail, nCapacity;
+} DEQUE;
+
+static struct {
+	// Settings
+	PSECURITY_DESCRIPTOR pOwnerSD;  // Owner to set (owner verb)
+	PSECURITY_DESCRIPTOR pDaclSD;   // DACL to set (dacl verb)
+	BOOL bReset;                    // Rebuild the DACLs from inheritance (reset verb)
+	int nThreads;
+
+	// Engine
+	HANDLE hToken;      // Impersonation token of the workers
+	HANDLE hSemaphore;  // Count of queued tasks
+	DEQUE* pDeques;
+	volatile LONG nPending;  // Queued or running tasks
+	volatile LONG bStop;
+
+	// Progress counters
+	volatile LONG nFiles, nDirectories, nErrors;
+} acl;
+
+static const GENERIC_MAPPING fileMapping = {
+	FILE_GENERIC_READ, FILE_GENERIC_WRITE, FILE_GENERIC_EXECUTE, FILE_ALL_ACCESS
+};
+
+
+//
+// Convert a SDDL string to a security descriptor (LocalFree must free it).
+//
+static int convertSddl( const wchar_t* pwszSddl, PSECURITY_DESCRIPTOR* ppSD )
+{
+	if (*ppSD) LocalFree( *ppSD );
+	*ppSD = NULL;
+	if (! ConvertStringSecurityDescriptorToSecurityDescriptor( pwszSddl,
+		SDDL_REVISION_1, ppSD, NULL )) {
+		printError( L"Invalid SDDL string", GetLastError(), 0 );
+		return 1;
+	}
+	return 0;
+}
+
+
+static void reportError( const wchar_t* pwszPath, DWORD dwError )
+{
+	InterlockedIncrement( &acl.nErrors );
+	printError( pwszPath, dwError, 0 );
+}
+
+
+static void pushTask( int iWorker, const wchar_t* pwszPath, size_t nPathLen,
+	PSECURITY_DESCRIPTOR pSD )
+{
+	// The task, its path and its security descriptor share one allocation
+	size_t nSDOffset = (sizeof( TASK ) + (nPathLen + 1) * sizeof( wchar_t ) +
+		sizeof( void* ) - 1) & ~(sizeof( void* ) - 1);
+	DWORD nSDLength = pSD ? GetSecurityDescriptorLength( pSD ) : 0;
+	TASK* pTask = allocHeap( 0, nSDOffset + nSDLength );
+	pTask->nPathLen = nPathLen;
+	memcpy( pTask->wszPath, pwszPath, nPathLen * sizeof( wchar_t ) );
+	pTask->wszPath[ nPathLen ] = L'\0';
+	pTask->pSD = NULL;
+	if (pSD) {
+		pTask->pSD = (BYTE*) pTask + nSDOffset;
+		memcpy( pTask->pSD, pSD, nSDLength );
+	}
+
+	InterlockedIncrement( &acl.nPending );
+
+	DEQUE* pDeque = &acl.pDeques[ iWorker ];
+	EnterCriticalSection( &pDeque->lock );
+	if (pDeque->nTail == pDeque->nCapacity) {
+		if (pDeque->nHead) {
+			// Reuse the room left by the thieves
+			pDeque->nTail -= pDeque->nHead;
+			memmove( pDeque->ppTasks, pDeque->ppTasks + pDeque->nHead,
+				pDeque->nTail * sizeof( TASK* ) );
+			pDeque->nHead = 0;
+		}
+		else {
+			pDeque->nCapacity *= 2;
+			TASK** ppTasks = allocHeap( 0, pDeque->nCapacity * sizeof( TASK* ) );
+			memcpy( ppTasks, pDeque->ppTasks, pDeque->nTail * sizeof( TASK* ) );
+			freeHeap( pDeque->ppTasks );
+			pDeque->ppTasks = ppTasks;
+		}
+	}
+	pDeque->ppTasks[ pDeque->nTail++ ] = pTask;
+	LeaveCriticalSection( &pDeque->lock );
+
+	ReleaseSemaphore( acl.hSemaphore, 1, NULL );
+}
+
+
+static TASK* popTask( DEQUE* pDeque, BOOL bSteal )
+{
+	TASK* pTask = NULL;
+	EnterCriticalSection( &pDeque->lock );
+	if (pDeque->nHead < pDeque->nTail)
+		pTask = bSteal ? pDeque->ppTasks[ pDeque->nHead++ ] : pDeque->ppTasks[ --pDeque->nTail ];
+	if (pDeque->nHead == pDeque->nTail) pDeque->nHead = pDeque->nTail = 0;
+	LeaveCriticalSection( &pDeque->lock );
+	return pTask;
+}
+
+
+//
+// Take a task after a successful wait on the semaphore: there is at least one
+// queued task for this worker, in its own deque or in another one.
+//
+static TASK* takeTask( int iWorker )
+{
+	TASK* pTask = popTask( &acl.pDeques[ iWorker ], FALSE );
+	for (int i = 1; ! pTask; i++)
+		pTask = popTask( &acl.pDeques[ (iWorker + i) % acl.nThreads ], TRUE );
+	return pTask;
+}
+
+
+//
+// Set the owner and/or the DACL of an object.
+//
+static BOOL applySecurity( const wchar_t* pwszPath, PSECURITY_DESCRIPTOR pDaclSD )
+{
+	DWORD dwAccess = 0;
+	if (acl.pOwnerSD) dwAccess |= WRITE_OWNER;
+	if (pDaclSD) dwAccess |= WRITE_DAC;
+
+	// The backup semantics grant the access through SeBackup/SeRestorePrivilege.
+	// Reparse points are processed themselves, not their target.
+	HANDLE hFile = CreateFile( pwszPath, dwAccess,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL );
+	BOOL bSuccess = (hFile != INVALID_HANDLE_VALUE);
+
+	// Unlike SetNamedSecurityInfo, SetKernelObjectSecurity does not propagate
+	// the inheritable ACEs to the subtree: the workers do it.
+	if (bSuccess && acl.pOwnerSD)
+		bSuccess = SetKernelObjectSecurity( hFile, OWNER_SECURITY_INFORMATION, acl.pOwnerSD );
+	if (bSuccess && pDaclSD)
+		bSuccess = SetKernelObjectSecurity( hFile, DACL_SECURITY_INFORMATION, pDaclSD );
+
+	if (! bSuccess) reportError( pwszPath, GetLastError() );
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle( hFile );
+	return bSuccess;
+}
+
+
+//
+// Whether the DACL of a security descriptor has inheritable ACEs for a creator
+// SID (CREATOR OWNER, CREATOR GROUP...). The DACL inherited from it then
+// depends on the owner and group of each object.
+//
+static BOOL hasCreatorAces( PSECURITY_DESCRIPTOR pSD )
+{
+	PACL pDacl = NULL;
+	BOOL bDaclPresent = FALSE, bDaclDefaulted = FALSE;
+	if (! GetSecurityDescriptorDacl( pSD, &bDaclPresent, &pDacl, &bDaclDefaulted ) ||
+		! bDaclPresent || ! pDacl)
+		return FALSE;
+
+	SID_IDENTIFIER_AUTHORITY creatorAuthority = SECURITY_CREATOR_SID_AUTHORITY;
+	for (DWORD i = 0; i < pDacl->AceCount; i++) {
+		ACE_HEADER* pAce;
+		if (! GetAce( pDacl, i, (LPVOID*) &pAce ) ||
+			! (pAce->AceFlags & (OBJECT_INHERIT_ACE | CONTAINER_INHERIT_ACE)))
+			continue;
+		// Same layout for the allowed and denied ACEs
+		if (pAce->AceType != ACCESS_ALLOWED_ACE_TYPE && pAce->AceType != ACCESS_DENIED_ACE_TYPE)
+			continue;
+		PSID pSid = (PSID) &((ACCESS_ALLOWED_ACE*) pAce)->SidStart;
+		if (! memcmp( GetSidIdentifierAuthority( pSid ), &creatorAuthority,
+			sizeof( creatorAuthority ) ))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+//
+// Compute the security descriptor inherited by an object from its parent.
+// The owner and group of the creator descriptor (if any) replace CREATOR OWNER
+// and CREATOR GROUP, otherwise those of the parent are used.
+//
+static PSECURITY_DESCRIPTOR inheritSecurity( PSECURITY_DESCRIPTOR pParentSD,
+	PSECURITY_DESCRIPTOR pCreatorSD, BOOL bDirectory )
+{
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	if (! CreatePrivateObjectSecurityEx( pParentSD, pCreatorSD, &pSD, NULL, bDirectory,
+		SEF_DACL_AUTO_INHERIT | SEF_AVOID_OWNER_CHECK | SEF_AVOID_PRIVILEGE_CHECK |
+		SEF_DEFAULT_OWNER_FROM_PARENT | SEF_DEFAULT_GROUP_FROM_PARENT,
+		NULL, (PGENERIC_MAPPING) &fileMapping ))
+		return NULL;
+	return pSD;
+}
+
+
+//
+// Read parts of the security descriptor of an object (LocalFree must free the
+// result).
+//
+static PSECURITY_DESCRIPTOR getSecurity( const wchar_t* pwszPath,
+	SECURITY_INFORMATION securityInfo )
+{
+	HANDLE hFile = CreateFile( pwszPath, READ_CONTROL,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL );
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	DWORD dwResult = (hFile != INVALID_HANDLE_VALUE) ?
+		GetSecurityInfo( hFile, SE_FILE_OBJECT, securityInfo, NULL, NULL, NULL, NULL,
+			&pSD ) : GetLastError();
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle( hFile );
+	if (dwResult != ERROR_SUCCESS) {
+		reportError( pwszPath, dwResult );
+		return NULL;
+	}
+	return pSD;
+}
+
+
+//
+// Enumerate a directory and process its entries. pwszPath is the work buffer
+// of the worker (MAX_LONG_PATH characters).
+//
+static void processDirectory( int iWorker, TASK* pTask, wchar_t* pwszPath )
+{
+	size_t nLen = pTask->nPathLen;
+	memcpy( pwszPath, pTask->wszPath, nLen * sizeof( wchar_t ) );
+	if (pwszPath[ nLen - 1 ] != L'\\') pwszPath[ nLen++ ] = L'\\';
+	pwszPath[ nLen ] = L'*';
+	pwszPath[ nLen + 1 ] = L'\0';
+
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = findFirstEntry( pwszPath, &findData );
+	if (hFind == INVALID_HANDLE_VALUE) {
+		DWORD dwError = GetLastError();
+		if (dwError != ERROR_FILE_NOT_FOUND) reportError( pTask->wszPath, dwError );
+		return;
+	}
+
+	// Inherited security descriptors of the files [0] and subdirectories [1]
+	PSECURITY_DESCRIPTOR apInheritedSD[ 2 ] = { NULL, NULL };
+	BOOL abInheritedFailed[ 2 ] = { FALSE, FALSE };
+
+	// Owner-dependent inheritance: one DACL per object, from its own owner
+	BOOL bPerObject = acl.bReset && ! acl.pOwnerSD && hasCreatorAces( pTask->pSD );
+
+	do {
+		const wchar_t* pwszName = findData.cFileName;
+		if (pwszName[ 0 ] == L'.' && (! pwszName[ 1 ] ||
+			(pwszName[ 1 ] == L'.' && ! pwszName[ 2 ])))
+			continue;
+
+		size_t nNameLen = wcslen( pwszName );
+		if (nLen + nNameLen >= MAX_LONG_PATH) {
+			reportError( pTask->wszPath, ERROR_FILENAME_EXCED_RANGE );
+			continue;
+		}
+		memcpy( pwszPath + nLen, pwszName, (nNameLen + 1) * sizeof( wchar_t ) );
+
+		int bDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 1 : 0;
+		PSECURITY_DESCRIPTOR pDaclSD = acl.pDaclSD;
+		PSECURITY_DESCRIPTOR pObjectSD = NULL;  // Inherited by this object only
+		if (bPerObject) {
+			PSECURITY_DESCRIPTOR pOwnerSD = getSecurity( pwszPath,
+				OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION );
+			if (pOwnerSD) {
+				pObjectSD = inheritSecurity( pTask->pSD, pOwnerSD, bDirectory );
+				if (! pObjectSD) reportError( pwszPath, GetLastError() );
+				LocalFree( pOwnerSD );
+			}
+			pDaclSD = pObjectSD;
+			if (! pDaclSD) continue;
+		}
+		else if (acl.bReset) {
+			// The owner set by the owner verb (if any) replaces CREATOR OWNER
+			if (! apInheritedSD[ bDirectory ] && ! abInheritedFailed[ bDirectory ]) {
+				apInheritedSD[ bDirectory ] = inheritSecurity( pTask->pSD, acl.pOwnerSD,
+					bDirectory );
+				if (! apInheritedSD[ bDirectory ]) {
+					abInheritedFailed[ bDirectory ] = TRUE;
+					reportError( pTask->wszPath, GetLastError() );
+				}
+			}
+			pDaclSD = apInheritedSD[ bDirectory ];
+			if (! pDaclSD) continue;
+		}
+
+		applySecurity( pwszPath, pDaclSD );
+
+		if (bDirectory) {
+			InterlockedIncrement( &acl.nDirectories );
+			// Do not follow junctions and directory symbolic links
+			if (! (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				pushTask( iWorker, pwszPath, nLen + nNameLen, acl.bReset ? pDaclSD : NULL );
+		}
+		else InterlockedIncrement( &acl.nFiles );
+
+		if (pObjectSD) DestroyPrivateObjectSecurity( &pObjectSD );
+	} while (FindNextFile( hFind, &findData ));
+
+	DWORD dwError = GetLastError();
+	if (dwError != ERROR_NO_MORE_FILES) reportError( pTask->wszPath, dwError );
+	FindClose( hFind );
+
+	for (int i = 0; i < 2; i++)
+		if (apInheritedSD[ i ]) DestroyPrivateObjectSecurity( &apInheritedSD[ i ] );
+}
+
+
+static DWORD WINAPI aclWorker( LPVOID pParameter )
+{
+	int iWorker = (int) (INT_PTR) pParameter;
+	SetThreadToken( NULL, acl.hToken );
+	wchar_t* pwszPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+
+	for (;;) {
+		WaitForSingleObject( acl.hSemaphore, INFINITE );
+		if (acl.bStop) break;
+
+		TASK* pTask = takeTask( iWorker );
+		processDirectory( iWorker, pTask, pwszPath );
+		freeHeap( pTask );
+
+		// The last task is done when no other one was queued meanwhile
+		if (InterlockedDecrement( &acl.nPending ) == 0) {
+			acl.bStop = TRUE;
+			ReleaseSemaphore( acl.hSemaphore, acl.nThreads, NULL );
+		}
+	}
+
+	freeHeap( pwszPath );
+	return 0;
+}
+
+
+static void printProgress( const wchar_t* pwszPrefix )
+{
+	printFmtConsole( L"%ls%ld files, %ld directories, %ld errors", pwszPrefix,
+		acl.nFiles, acl.nDirectories, acl.nErrors );
+}
+
+
+//
+// Walk the tree of a root directory with the worker pool.
+//
+static void runWorkers( const wchar_t* pwszPath, size_t nPathLen, PSECURITY_DESCRIPTOR pSD )
+{
+	HANDLE ahThreads[ MAXIMUM_WAIT_OBJECTS ];
+	int nThreads = 0;
+
+	acl.pDeques = allocHeap( HEAP_ZERO_MEMORY, acl.nThreads * sizeof( DEQUE ) );
+	for (int i = 0; i < acl.nThreads; i++) {
+		InitializeCriticalSection( &acl.pDeques[ i ].lock );
+		acl.pDeques[ i ].nCapacity = 256;
+		acl.pDeques[ i ].ppTasks = allocHeap( 0, 256 * sizeof( TASK* ) );
+	}
+
+	pushTask( 0, pwszPath, nPathLen, pSD );
+
+	for (int i = 0; i < acl.nThreads; i++) {
+		ahThreads[ nThreads ] = CreateThread( NULL, 64 * 1024, aclWorker,
+			(LPVOID) (INT_PTR) i, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL );
+		if (ahThreads[ nThreads ]) nThreads++;
+	}
+
+	if (nThreads) {
+		// Print the progress every second on the console
+		DWORD dwMode;
+		BOOL bConsole = GetConsoleMode( GetStdHandle( STD_OUTPUT_HANDLE ), &dwMode );
+		while (WaitForMultipleObjects( nThreads, ahThreads, TRUE, 1000 ) == WAIT_TIMEOUT)
+			if (bConsole) printProgress( L"\r" );
+		if (bConsole) printConsole( L"\r" );
+	}
+	else {
+		// No worker could be created: process the tasks on this thread
+		wchar_t* pwszWorkPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+		TASK* pTask;
+		while ((pTask = popTask( &acl.pDeques[ 0 ], FALSE ))) {
+			processDirectory( 0, pTask, pwszWorkPath );
+			freeHeap( pTask );
+		}
+		freeHeap( pwszWorkPath );
+	}
+
+	for (int i = 0; i < nThreads; i++) CloseHandle( ahThreads[ i ] );
+	for (int i = 0; i < acl.nThreads; i++) {
+		DeleteCriticalSection( &acl.pDeques[ i ].lock );
+		freeHeap( acl.pDeques[ i ].ppTasks );
+	}
+	freeHeap( acl.pDeques );
+}
+
+
+//
+// Convert an owner SID to a security descriptor with only an owner: "O:<sid>".
+//
+static int convertOwner( const wchar_t* pwszSid, PSECURITY_DESCRIPTOR* ppSD )
+{
+	size_t nLen = wcslen( pwszSid );
+	wchar_t* pwszSddl = allocHeap( 0, (nLen + 3) * sizeof( wchar_t ) );
+	memcpy( pwszSddl, L"O:", 2 * sizeof( wchar_t ) );
+	memcpy( pwszSddl + 2, pwszSid, (nLen + 1) * sizeof( wchar_t ) );
+	int errCode = convertSddl( pwszSddl, ppSD );
+	freeHeap( pwszSddl );
+	return errCode;
+}
+
+
+static int checkOwnerVerb( wchar_t** argv )
+{
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	int errCode = convertOwner( argv[ 0 ], &pSD );
+	if (pSD) LocalFree( pSD );
+	return errCode;
+}
+
+
+static int ownerVerb( wchar_t** argv )
+{
+	return convertOwner( argv[ 0 ], &acl.pOwnerSD );
+}
+
+
+static int checkDaclVerb( wchar_t** argv )
+{
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	int errCode = convertSddl( argv[ 0 ], &pSD );
+	if (pSD) LocalFree( pSD );
+	return errCode;
+}
+
+
+static int daclVerb( wchar_t** argv )
+{
+	acl.bReset = FALSE;
+	return convertSddl( argv[ 0 ], &acl.pDaclSD );
+}
+
+
+static int resetVerb( wchar_t** argv )
+{
+	if (acl.pDaclSD) LocalFree( acl.pDaclSD );
+	acl.pDaclSD = NULL;
+	acl.bReset = TRUE;
+	return 0;
+}
+
+
+static int checkThreadsVerb( wchar_t** argv )
+{
+	DWORD nThreads;
+	return parseNumberArgument( argv[ 0 ], L"number of threads", 1, MAXIMUM_WAIT_OBJECTS,
+		&nThreads );
+}
+
+
+static int threadsVerb( wchar_t** argv )
+{
+	DWORD nThreads;
+	int errCode = parseNumberArgument( argv[ 0 ], L"number of threads", 1,
+		MAXIMUM_WAIT_OBJECTS, &nThreads );
+	if (! errCode) acl.nThreads = (int) nThreads;
+	return errCode;
+}
+
+
+//
+// Compute the DACL inherited by a root that is not walked (reset mode), from
+// its parent directory. Return NULL (reported) on failure.
+//
+static PSECURITY_DESCRIPTOR inheritRootSecurity( wchar_t* pwszPath, size_t nPathLen,
+	BOOL bDirectory )
+{
+	// Parent directory (with its trailing backslash if it is a drive root)
+	while (nPathLen > 0 && pwszPath[ nPathLen - 1 ] == L'\\') nPathLen--;
+	size_t nParentLen = nPathLen;
+	while (nParentLen > 0 && pwszPath[ nParentLen - 1 ] != L'\\') nParentLen--;
+	if (nParentLen > 1 && pwszPath[ nParentLen - 2 ] != L':') nParentLen--;
+	wchar_t cSaved = pwszPath[ nParentLen ];
+	pwszPath[ nParentLen ] = L'\0';
+	PSECURITY_DESCRIPTOR pParentSD = getSecurity( pwszPath, OWNER_SECURITY_INFORMATION |
+		GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION );
+	pwszPath[ nParentLen ] = cSaved;
+	if (! pParentSD) return NULL;
+
+	// The owner set by the owner verb, or the object's own owner, replaces
+	// CREATOR OWNER
+	PSECURITY_DESCRIPTOR pOwnerSD = NULL;
+	BOOL bOwnOwner = ! acl.pOwnerSD && hasCreatorAces( pParentSD );
+	if (bOwnOwner)
+		pOwnerSD = getSecurity( pwszPath, OWNER_SECURITY_INFORMATION |
+			GROUP_SECURITY_INFORMATION );
+
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	if (! bOwnOwner || pOwnerSD) {
+		pSD = inheritSecurity( pParentSD, acl.pOwnerSD ? acl.pOwnerSD : pOwnerSD,
+			bDirectory );
+		if (! pSD) reportError( pwszPath, GetLastError() );
+	}
+	if (pOwnerSD) LocalFree( pOwnerSD );
+	LocalFree( pParentSD );
+	return pSD;
+}
+
+
+static int applyVerb( wchar_t** argv )
+{
+	if (! acl.pOwnerSD && ! acl.pDaclSD && ! acl.bReset) {
+		printError( L"Nothing to apply (use owner, dacl or reset before apply)", 0, 0 );
+		return 1;
+	}
+
+	size_t nPathLen;
+	wchar_t* pwszPath = getLongPath( argv[ 0 ], &nPathLen );
+	if (! pwszPath) {
+		printError( L"Invalid path", GetLastError(), 0 );
+		return 1;
+	}
+
+	if (! acl.nThreads) {
+		// The work is mostly waiting for the file system
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo( &systemInfo );
+		acl.nThreads = systemInfo.dwNumberOfProcessors * 2;
+		if (acl.nThreads > MAXIMUM_WAIT_OBJECTS) acl.nThreads = MAXIMUM_WAIT_OBJECTS;
+	}
+
+	acl.nFiles = acl.nDirectories = acl.nErrors = 0;
+	acl.nPending = 0;
+	acl.bStop = FALSE;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency( &frequency );
+	QueryPerformanceCounter( &start );
+
+	int errCode = 0;
+	DWORD dwAttributes = GetFileAttributes( pwszPath );
+	if (dwAttributes == INVALID_FILE_ATTRIBUTES) {
+		printError( L"Failed to open path", GetLastError(), 0 );
+		errCode = 7;
+	}
+	else {
+		// A directory root keeps its DACL in reset mode: it is the source of the
+		// inheritance. Another root inherits from its parent.
+		BOOL bDirectory = (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			! (dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+		if (! bDirectory && acl.bReset) {
+			PSECURITY_DESCRIPTOR pInheritedSD = inheritRootSecurity( pwszPath, nPathLen,
+				(dwAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 );
+			if (pInheritedSD) {
+				applySecurity( pwszPath, pInheritedSD );
+				DestroyPrivateObjectSecurity( &pInheritedSD );
+			}
+		}
+		else if (acl.pOwnerSD || acl.pDaclSD) applySecurity( pwszPath, acl.pDaclSD );
+		if (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) InterlockedIncrement( &acl.nDirectories );
+		else InterlockedIncrement( &acl.nFiles );
+
+		PSECURITY_DESCRIPTOR pRootSD = NULL;
+		if (bDirectory && acl.bReset) {
+			pRootSD = getSecurity( pwszPath, OWNER_SECURITY_INFORMATION |
+				GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION );
+			if (! pRootSD) bDirectory = FALSE;
+		}
+
+		if (bDirectory) {
+			OpenThreadToken( GetCurrentThread(), TOKEN_IMPERSONATE | TOKEN_QUERY, TRUE,
+				&acl.hToken );
+			acl.hSemaphore = CreateSemaphore( NULL, 0, LONG_MAX, NULL );
+			if (acl.hSemaphore) {
+				runWorkers( pwszPath, nPathLen, pRootSD );
+				CloseHandle( acl.hSemaphore );
+			}
+			else reportError( pwszPath, GetLastError() );
+			if (acl.hToken) CloseHandle( acl.hToken );
+			acl.hToken = NULL;
+		}
+		if (pRootSD) LocalFree( pRootSD );
+
+		QueryPerformanceCounter( &end );
+		double dSeconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+		LONG nObjects = acl.nFiles + acl.nDirectories;
+		printProgress( L"" );
+		printFmtConsole( L" in %.2f s (%.0f objects/s, %d threads)\n", dSeconds,
+			dSeconds > 0 ? nObjects / dSeconds : 0.0, acl.nThreads );
+
+		if (acl.nErrors) errCode = 7;
+	}
+
+	freeHeap( pwszPath );
+	return errCode;
+}
+
+
+static const VERB aclVerbs[] = {
+	{ L"owner", 1, ownerVerb, checkOwnerVerb },
+	{ L"dacl", 1, daclVerb, checkDaclVerb },
+	{ L"reset", 0, resetVerb },
+	{ L"threads", 1, threadsVerb, checkThreadsVerb },
+	{ L"apply", 1, applyVerb }
+};
+
+
+int runAclCommand( int argc, wchar_t** argv )
+{
+	int errCode = runVerbs( aclVerbs, sizeof( aclVerbs ) / sizeof( *aclVerbs ), argc, argv );
+	if (acl.pOwnerSD) LocalFree( acl.pOwnerSD );
+	if (acl.pDaclSD) LocalFree( acl.pDaclSD );
+	return errCode;
+}
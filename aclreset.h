@@ -0,0 +1,13 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	aclreset.h
+
+	Built-in recursive ownership and ACL reset
+
+*/
+
+int runAclCommand( int argc, wchar_t** argv );
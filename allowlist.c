@@ -0,0 +1,480 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	allowlist.c
+
+	Allowlist of the commands run as TrustedInstaller
+
+	The policy file lists the SHA-256 hashes of the approved images, one per
+	line: 64 hexadecimal digits, optionally followed by a comment. Empty lines
+	and lines beginning with '#' are ignored.
+
+	Hashing an image on every launch would be slow for large binaries, so the
+	hashes are cached in "<policy file>.cache". The cache is keyed by the
+	identity of the file (volume serial number, file index), its size, and its
+	update sequence number (USN) in the change journal of the volume: a cached
+	image is not read at all. The USN changes with every write and cannot be set
+	from user mode, unlike the file times. Without a change journal, images are
+	hashed every time. The hash (not the verdict) is cached, so the cache remains
+	valid when the policy changes.
+
+	The key of an entry can be read by any user, so a cache writable by others
+	would map any image to an allowed hash. The cache is only used if it is
+	owned by the System or the administrators and its protected DACL grants
+	access to them only; otherwise it is deleted and created again.
+
+*/
+
+#include <windows.h>
+#include <wincrypt.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <winioctl.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"   // Leveled logging
+
+#define HASH_SIZE 32  // SHA-256
+
+// Maximum size of the policy and cache files
+#define MAX_FILE_SIZE (16 * 1024 * 1024)
+
+// Size of the mapped views of a hashed image (multiple of the allocation
+// granularity)
+#define HASH_VIEW_SIZE (16 * 1024 * 1024)
+
+#define CACHE_SIGNATURE 0x32415553  // "SUA2"
+#define CACHE_MAX_ENTRIES 4096      // The cache is reset beyond this
+
+// Only the System and the administrators can modify the cache
+#define CACHE_SDDL L"O:BAD:P(A;;FA;;;SY)(A;;FA;;;BA)"
+
+typedef struct {
+	DWORD dwSignature;
+	DWORD nEntrySize;
+} CACHE_HEADER;
+
+typedef struct {
+	DWORD dwVolumeSerialNumber;
+	DWORD nFileIndexHigh;
+	DWORD nFileIndexLow;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	LONGLONG usn;             // Last change journal record of the file
+	LARGE_INTEGER changeTime; // Also checked, in case the journal is recreated
+	BYTE hash[ HASH_SIZE ];
+} CACHE_ENTRY;
+
+
+//
+// Read an open file into a buffer allocated from the process heap.
+// Return 0 or an error code.
+//
+static DWORD readFileData( HANDLE hFile, BYTE** ppData, DWORD* pnSize )
+{
+	*ppData = NULL;
+	*pnSize = 0;
+
+	DWORD dwLastError = 0;
+	LARGE_INTEGER size;
+	if (! GetFileSizeEx( hFile, &size )) dwLastError = GetLastError();
+	else if (size.QuadPart > MAX_FILE_SIZE) dwLastError = ERROR_FILE_TOO_LARGE;
+	else {
+		*ppData = allocHeap( 0, size.LowPart + 1 );
+		DWORD nRead;
+		if (! ReadFile( hFile, *ppData, size.LowPart, &nRead, NULL ))
+			dwLastError = GetLastError();
+		else *pnSize = nRead;
+	}
+
+	if (dwLastError && *ppData) {
+		freeHeap( *ppData );
+		*ppData = NULL;
+	}
+	return dwLastError;
+}
+
+
+//
+// Read a whole file into a buffer allocated from the process heap.
+// Return 0 or an error code.
+//
+static DWORD readWholeFile( const wchar_t* pcwszPath, BYTE** ppData, DWORD* pnSize )
+{
+	HANDLE hFile = CreateFile( pcwszPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (hFile == INVALID_HANDLE_VALUE) {
+		*ppData = NULL;
+		*pnSize = 0;
+		return GetLastError();
+	}
+
+	DWORD dwLastError = readFileData( hFile, ppData, pnSize );
+	CloseHandle( hFile );
+	return dwLastError;
+}
+
+
+static int hexDigit( BYTE c )
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+//
+// Load the hashes of a policy file.
+// Return the number of hashes, or -1 if the file is invalid.
+//
+static int loadPolicy( const wchar_t* pcwszPolicyFile, BYTE** ppHashes )
+{
+	BYTE* pData;
+	DWORD nSize;
+	DWORD dwLastError = readWholeFile( pcwszPolicyFile, &pData, &nSize );
+	if (dwLastError) {
+		printError( L"Failed to read policy file", dwLastError, 0 );
+		return -1;
+	}
+
+	// A hash takes at least 65 bytes (with the end of line)
+	*ppHashes = allocHeap( 0, (nSize / 65 + 1) * HASH_SIZE );
+	int nHashes = 0;
+
+	BYTE* p = pData;
+	BYTE* pEnd = pData + nSize;
+	// Skip the UTF-8 BOM
+	if (nSize >= 3 && p[ 0 ] == 0xEF && p[ 1 ] == 0xBB && p[ 2 ] == 0xBF) p += 3;
+
+	while (p < pEnd) {
+		BYTE* pLine = p;
+		while (p < pEnd && *p != '\n') p++;
+		BYTE* pLineEnd = p++;
+
+		while (pLine < pLineEnd && (*pLine == ' ' || *pLine == '\t')) pLine++;
+		if (pLine == pLineEnd || *pLine == '#' || *pLine == '\r') continue;
+
+		// 64 hexadecimal digits, followed by the end of line or a blank
+		BYTE* pHash = *ppHashes + nHashes * HASH_SIZE;
+		BOOL bValid = pLineEnd - pLine >= 2 * HASH_SIZE;
+		for (int i = 0; bValid && i < HASH_SIZE; i++) {
+			int iHigh = hexDigit( pLine[ 2 * i ] );
+			int iLow = hexDigit( pLine[ 2 * i + 1 ] );
+			bValid = iHigh >= 0 && iLow >= 0;
+			pHash[ i ] = (BYTE) (iHigh << 4 | iLow);
+		}
+		if (bValid && pLine + 2 * HASH_SIZE < pLineEnd) {
+			BYTE c = pLine[ 2 * HASH_SIZE ];
+			bValid = c == ' ' || c == '\t' || c == '\r';
+		}
+		if (! bValid) {
+			printError( L"Invalid policy file", 0, 0 );
+			freeHeap( *ppHashes );
+			freeHeap( pData );
+			return -1;
+		}
+		nHashes++;
+	}
+
+	freeHeap( pData );
+	return nHashes;
+}
+
+
+//
+// Compute the SHA-256 hash of a file.
+//
+// The file is read through views of a mapping: its pages are hashed where the
+// cache manager maps them, without copying them to a buffer.
+//
+static DWORD hashFile( HANDLE hFile, ULONGLONG nFileSize, BYTE* pHash )
+{
+	DWORD dwLastError = 0;
+	HCRYPTPROV hProv = 0;
+	HCRYPTHASH hHash = 0;
+
+	if (! CryptAcquireContext( &hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT ) ||
+		! CryptCreateHash( hProv, CALG_SHA_256, 0, 0, &hHash ))
+		dwLastError = GetLastError();
+
+	// An empty file cannot be mapped
+	HANDLE hMapping = NULL;
+	if (! dwLastError && nFileSize) {
+		hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+		if (! hMapping) dwLastError = GetLastError();
+	}
+
+	for (ULONGLONG nOffset = 0; ! dwLastError && nOffset < nFileSize;
+		nOffset += HASH_VIEW_SIZE) {
+		DWORD nViewSize = nFileSize - nOffset < HASH_VIEW_SIZE ?
+			(DWORD) (nFileSize - nOffset) : HASH_VIEW_SIZE;
+		BYTE* pView = MapViewOfFile( hMapping, FILE_MAP_READ, (DWORD) (nOffset >> 32),
+			(DWORD) nOffset, nViewSize );
+		if (! pView) {
+			dwLastError = GetLastError();
+			break;
+		}
+		if (! CryptHashData( hHash, pView, nViewSize, 0 )) dwLastError = GetLastError();
+		UnmapViewOfFile( pView );
+	}
+
+	DWORD dwHashSize = HASH_SIZE;
+	if (! dwLastError && ! CryptGetHashParam( hHash, HP_HASHVAL, pHash, &dwHashSize, 0 ))
+		dwLastError = GetLastError();
+
+	if (hMapping) CloseHandle( hMapping );
+	if (hHash) CryptDestroyHash( hHash );
+	if (hProv) CryptReleaseContext( hProv, 0 );
+	return dwLastError;
+}
+
+
+static BOOL isSameFile( const CACHE_ENTRY* pEntry, const CACHE_ENTRY* pKey )
+{
+	return pEntry->dwVolumeSerialNumber == pKey->dwVolumeSerialNumber &&
+		pEntry->nFileIndexHigh == pKey->nFileIndexHigh &&
+		pEntry->nFileIndexLow == pKey->nFileIndexLow &&
+		pEntry->nFileSizeHigh == pKey->nFileSizeHigh &&
+		pEntry->nFileSizeLow == pKey->nFileSizeLow &&
+		pEntry->usn == pKey->usn &&
+		pEntry->changeTime.QuadPart == pKey->changeTime.QuadPart;
+}
+
+
+//
+// Get the USN of a file, or 0 if the volume has no change journal.
+//
+static LONGLONG getFileUsn( HANDLE hFile )
+{
+	// The record is followed by the file name
+	union {
+		USN_RECORD record;
+		BYTE buffer[ sizeof( USN_RECORD ) + MAX_PATH * sizeof( wchar_t ) ];
+	} usnData;
+	DWORD nReturned;
+	if (! DeviceIoControl( hFile, FSCTL_READ_FILE_USN_DATA, NULL, 0, &usnData,
+		sizeof( usnData ), &nReturned, NULL ) || nReturned < sizeof( USN_RECORD ))
+		return 0;
+	return usnData.record.Usn;
+}
+
+
+static BOOL isSystemOrAdministrators( PSID pSid )
+{
+	return IsWellKnownSid( pSid, WinLocalSystemSid ) ||
+		IsWellKnownSid( pSid, WinBuiltinAdministratorsSid );
+}
+
+
+//
+// Check that only the System and the administrators can modify the cache:
+// it is owned by one of them, and its protected DACL allows them only.
+//
+static BOOL isTrustedCache( HANDLE hCache )
+{
+	PSID pOwner = NULL;
+	PACL pDacl = NULL;
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	if (GetSecurityInfo( hCache, SE_FILE_OBJECT,
+		OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+		&pOwner, NULL, &pDacl, NULL, &pSD ) != ERROR_SUCCESS)
+		return FALSE;
+
+	// A NULL DACL grants full access to everyone
+	SECURITY_DESCRIPTOR_CONTROL control = 0;
+	DWORD dwRevision;
+	BOOL bTrusted = pOwner && isSystemOrAdministrators( pOwner ) && pDacl &&
+		GetSecurityDescriptorControl( pSD, &control, &dwRevision ) &&
+		(control & SE_DACL_PROTECTED);
+
+	// Deny ACEs cannot grant access. Allow ACEs must be for them, and other
+	// types (object, callback...) are not expected.
+	for (DWORD i = 0; bTrusted && i < pDacl->AceCount; i++) {
+		ACE_HEADER* pAce;
+		bTrusted = GetAce( pDacl, i, (void**) &pAce ) &&
+			(pAce->AceType == ACCESS_DENIED_ACE_TYPE ||
+			(pAce->AceType == ACCESS_ALLOWED_ACE_TYPE && isSystemOrAdministrators(
+				(PSID) &((ACCESS_ALLOWED_ACE*) pAce)->SidStart )));
+	}
+
+	LocalFree( pSD );
+	return bTrusted;
+}
+
+
+//
+// Get the hash of an image from the cache, or compute it and add it to the
+// cache. The cache is only an optimization: its errors are ignored.
+//
+static DWORD getImageHash( const wchar_t* pcwszCacheFile, HANDLE hImage,
+	BYTE* pHash )
+{
+	BY_HANDLE_FILE_INFORMATION fileInfo;
+	FILE_BASIC_INFO basicInfo;
+	if (! GetFileInformationByHandle( hImage, &fileInfo ) ||
+		! GetFileInformationByHandleEx( hImage, FileBasicInfo, &basicInfo,
+			sizeof( basicInfo ) ))
+		return GetLastError();
+
+	CACHE_ENTRY key = {
+		.dwVolumeSerialNumber = fileInfo.dwVolumeSerialNumber,
+		.nFileIndexHigh = fileInfo.nFileIndexHigh,
+		.nFileIndexLow = fileInfo.nFileIndexLow,
+		.nFileSizeHigh = fileInfo.nFileSizeHigh,
+		.nFileSizeLow = fileInfo.nFileSizeLow,
+		.usn = getFileUsn( hImage ),
+		.changeTime = basicInfo.ChangeTime
+	};
+	if (! key.usn) logDebug( L"No change journal on the volume: the image hash is not cached" );
+
+	// Look up the cache. It is checked, read and appended through the same
+	// handle, so it cannot be replaced in between. Without FILE_WRITE_DATA,
+	// every write is appended.
+	HANDLE hCache = INVALID_HANDLE_VALUE;
+	if (key.usn) {
+		hCache = CreateFile( pcwszCacheFile, GENERIC_READ | FILE_APPEND_DATA,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, NULL );
+		if (hCache != INVALID_HANDLE_VALUE && ! isTrustedCache( hCache )) {
+			logDebug( L"The cache can be modified by other users: it is created again" );
+			CloseHandle( hCache );
+			hCache = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	BYTE* pCache;
+	DWORD nCacheSize;
+	BOOL bReset = TRUE;  // The cache must be created again
+	if (hCache != INVALID_HANDLE_VALUE && ! readFileData( hCache, &pCache, &nCacheSize )) {
+		const CACHE_HEADER* pHeader = (const CACHE_HEADER*) pCache;
+		DWORD nEntriesSize = nCacheSize - sizeof( CACHE_HEADER );
+		if (nCacheSize >= sizeof( CACHE_HEADER ) &&
+			pHeader->dwSignature == CACHE_SIGNATURE &&
+			pHeader->nEntrySize == sizeof( CACHE_ENTRY ) &&
+			nEntriesSize % sizeof( CACHE_ENTRY ) == 0) {
+			DWORD nEntries = nEntriesSize / sizeof( CACHE_ENTRY );
+			const CACHE_ENTRY* pEntries = (const CACHE_ENTRY*) (pHeader + 1);
+			for (DWORD i = 0; i < nEntries; i++)
+				if (isSameFile( &pEntries[ i ], &key )) {
+					memcpy( pHash, pEntries[ i ].hash, HASH_SIZE );
+					freeHeap( pCache );
+					CloseHandle( hCache );
+					logDebug( L"Image hash found in cache" );
+					return 0;
+				}
+			bReset = nEntries >= CACHE_MAX_ENTRIES;
+		}
+		freeHeap( pCache );
+	}
+
+	// Hash the image
+	DWORD dwStart = GetTickCount();
+	DWORD dwLastError = hashFile( hImage,
+		(ULONGLONG) fileInfo.nFileSizeHigh << 32 | fileInfo.nFileSizeLow, pHash );
+	if (! dwLastError) logDebug( L"Image hashed in %lu ms", GetTickCount() - dwStart );
+	if (dwLastError || ! key.usn) {
+		if (hCache != INVALID_HANDLE_VALUE) CloseHandle( hCache );
+		return dwLastError;
+	}
+
+	// Create the cache again. CREATE_ALWAYS would keep the security of an
+	// existing file, and CREATE_NEW fails if another one is created meanwhile.
+	if (bReset) {
+		if (hCache != INVALID_HANDLE_VALUE) CloseHandle( hCache );
+		DeleteFile( pcwszCacheFile );
+
+		SECURITY_ATTRIBUTES sa = { sizeof( SECURITY_ATTRIBUTES ), NULL, FALSE };
+		ConvertStringSecurityDescriptorToSecurityDescriptor( CACHE_SDDL, SDDL_REVISION_1,
+			&sa.lpSecurityDescriptor, NULL );
+		hCache = sa.lpSecurityDescriptor ? CreateFile( pcwszCacheFile, FILE_APPEND_DATA,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, CREATE_NEW, FILE_ATTRIBUTE_NORMAL,
+			NULL ) : INVALID_HANDLE_VALUE;
+		if (sa.lpSecurityDescriptor) LocalFree( sa.lpSecurityDescriptor );
+
+		if (hCache != INVALID_HANDLE_VALUE) {
+			CACHE_HEADER header = { CACHE_SIGNATURE, sizeof( CACHE_ENTRY ) };
+			DWORD nWritten;
+			WriteFile( hCache, &header, sizeof( header ), &nWritten, NULL );
+		}
+	}
+
+	// Add it to the cache. Appended entries are written in a single write,
+	// so concurrent instances cannot interleave them.
+	if (hCache != INVALID_HANDLE_VALUE) {
+		memcpy( key.hash, pHash, HASH_SIZE );
+		DWORD nWritten;
+		WriteFile( hCache, &key, sizeof( key ), &nWritten, NULL );
+		CloseHandle( hCache );
+	}
+	return 0;
+}
+
+
+int checkAllowlist( const wchar_t* pcwszPolicyFile, const wchar_t* pcwszCommandLine,
+	wchar_t** ppwszImagePath, HANDLE* phImage )
+{
+	*ppwszImagePath = NULL;
+	*phImage = NULL;
+
+	BYTE* pHashes;
+	int nHashes = loadPolicy( pcwszPolicyFile, &pHashes );
+	if (nHashes < 0) return 1;
+
+	int errCode = 0;
+	DWORD dwLastError = 0;
+
+	// Resolve the image and open it. Writing and deleting are denied as long
+	// as the handle is open, so the image cannot be replaced once checked.
+	wchar_t* pwszImagePath = resolveImagePath( pcwszCommandLine );
+	HANDLE hImage = INVALID_HANDLE_VALUE;
+	if (pwszImagePath) {
+		logDebug( L"Image: %ls", pwszImagePath );
+		hImage = CreateFile( pwszImagePath, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	}
+	if (hImage == INVALID_HANDLE_VALUE) {
+		printError( L"Failed to open image", GetLastError(), 0 );
+		errCode = 8;
+	}
+
+	if (! errCode) {
+		// Cache file: "<policy file>.cache"
+		size_t nLength = wcslen( pcwszPolicyFile );
+		wchar_t* pwszCacheFile = allocHeap( 0, (nLength + 7) * sizeof( wchar_t ) );
+		memcpy( pwszCacheFile, pcwszPolicyFile, nLength * sizeof( wchar_t ) );
+		memcpy( pwszCacheFile + nLength, L".cache", 7 * sizeof( wchar_t ) );
+
+		BYTE hash[ HASH_SIZE ];
+		dwLastError = getImageHash( pwszCacheFile, hImage, hash );
+		freeHeap( pwszCacheFile );
+
+		if (dwLastError) {
+			printError( L"Failed to hash image", dwLastError, 0 );
+			errCode = 8;
+		}
+		else {
+			errCode = 8;
+			for (int i = 0; i < nHashes; i++)
+				if (! memcmp( pHashes + i * HASH_SIZE, hash, HASH_SIZE )) {
+					errCode = 0;
+					break;
+				}
+			if (errCode) printError( L"Command not allowed by the policy", 0, 0 );
+		}
+	}
+
+	freeHeap( pHashes );
+
+	if (errCode) {
+		if (hImage != INVALID_HANDLE_VALUE) CloseHandle( hImage );
+		if (pwszImagePath) freeHeap( pwszImagePath );
+		return errCode;
+	}
+
+	*ppwszImagePath = pwszImagePath;
+	*phImage = hImage;
+	return 0;
+}
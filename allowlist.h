@@ -0,0 +1,18 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	allowlist.h
+
+	Allowlist of the commands run as TrustedInstaller
+
+*/
+
+// Check that the image of a command line is allowed by a policy file.
+// On success, *ppwszImagePath receives the full path of the image (to be freed
+// with freeHeap) and *phImage a handle preventing it from being modified until
+// it is closed.
+int checkAllowlist( const wchar_t* pcwszPolicyFile, const wchar_t* pcwszCommandLine,
+	wchar_t** ppwszImagePath, HANDLE* phImage );
@@ -0,0 +1,227 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	fileops.c
+
+	Built-in file operations
+
+	They are performed by superUser itself on a thread impersonating the
+	TrustedInstaller token, instead of creating cmd.exe and a tool for each one.
+
+*/
+
+#include <windows.h>
+#include <aclapi.h>
+#include <sddl.h>
+
+#include "utils.h" // Utility functions
+
+
+static int fileError( const wchar_t* pwszMessage )
+{
+	printError( pwszMessage, GetLastError(), 0 );
+	return 7;
+}
+
+
+static int setOwner( wchar_t* pwszPath, PSID pOwnerSid )
+{
+	DWORD dwResult = SetNamedSecurityInfo( pwszPath, SE_FILE_OBJECT,
+		OWNER_SECURITY_INFORMATION, pOwnerSid, NULL, NULL, NULL );
+	if (dwResult != ERROR_SUCCESS) {
+		printError( L"Failed to set owner", dwResult, 0 );
+		return 7;
+	}
+	return 0;
+}
+
+
+static int copyVerb( wchar_t** argv )
+{
+	if (! CopyFile( argv[ 0 ], argv[ 1 ], FALSE ))
+		return fileError( L"Failed to copy file" );
+	return 0;
+}
+
+
+static int moveVerb( wchar_t** argv )
+{
+	if (! MoveFileEx( argv[ 0 ], argv[ 1 ],
+		MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED ))
+		return fileError( L"Failed to move file" );
+	return 0;
+}
+
+
+static int checkRenameVerb( wchar_t** argv )
+{
+	const wchar_t* pwszNewName = argv[ 1 ];
+	if (wcschr( pwszNewName, L'\\' ) || wcschr( pwszNewName, L'/' )) {
+		printError( L"The new name must not contain a path", 0, 0 );
+		return 1;
+	}
+	return 0;
+}
+
+
+static int renameVerb( wchar_t** argv )
+{
+	// The new name replaces the last component of the path
+	const wchar_t* pwszNewName = argv[ 1 ];
+	wchar_t* pwszPath = argv[ 0 ];
+	size_t nDirLen = wcslen( pwszPath );
+	while (nDirLen > 0 && pwszPath[ nDirLen - 1 ] != L'\\' &&
+		pwszPath[ nDirLen - 1 ] != L'/' && pwszPath[ nDirLen - 1 ] != L':')
+		nDirLen--;
+
+	size_t nNameLen = wcslen( pwszNewName );
+	wchar_t* pwszNewPath = allocHeap( 0, (nDirLen + nNameLen + 1) * sizeof( wchar_t ) );
+	memcpy( pwszNewPath, pwszPath, nDirLen * sizeof( wchar_t ) );
+	memcpy( pwszNewPath + nDirLen, pwszNewName, (nNameLen + 1) * sizeof( wchar_t ) );
+
+	int errCode = 0;
+	if (! MoveFileEx( pwszPath, pwszNewPath, 0 ))
+		errCode = fileError( L"Failed to rename file" );
+
+	freeHeap( pwszNewPath );
+	return errCode;
+}
+
+
+static int deleteVerb( wchar_t** argv )
+{
+	wchar_t* pwszPath = argv[ 0 ];
+	DWORD dwAttributes = GetFileAttributes( pwszPath );
+	if (dwAttributes == INVALID_FILE_ATTRIBUTES)
+		return fileError( L"Failed to delete file" );
+
+	// Protected files are often read-only
+	if (dwAttributes & FILE_ATTRIBUTE_READONLY)
+		SetFileAttributes( pwszPath, dwAttributes & ~FILE_ATTRIBUTE_READONLY );
+
+	BOOL bSuccess;
+	if (dwAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		bSuccess = RemoveDirectory( pwszPath );
+	else
+		bSuccess = DeleteFile( pwszPath );
+
+	if (! bSuccess) {
+		int errCode = fileError( L"Failed to delete file" );
+		// The file is left as it was
+		if (dwAttributes & FILE_ATTRIBUTE_READONLY)
+			SetFileAttributes( pwszPath, dwAttributes );
+		return errCode;
+	}
+	return 0;
+}
+
+
+static int takeownVerb( wchar_t** argv )
+{
+	// Same as "takeown /a": the Administrators group becomes the owner
+	BYTE sidBuffer[ SECURITY_MAX_SID_SIZE ];
+	DWORD dwSidSize = sizeof( sidBuffer );
+	if (! CreateWellKnownSid( WinBuiltinAdministratorsSid, NULL, sidBuffer, &dwSidSize ))
+		return fileError( L"Failed to take ownership" );
+
+	return setOwner( argv[ 0 ], (PSID) sidBuffer );
+}
+
+
+static int checkOwnerVerb( wchar_t** argv )
+{
+	PSID pSid = NULL;
+	if (! ConvertStringSidToSid( argv[ 1 ], &pSid )) {
+		printError( L"Invalid owner SID", GetLastError(), 0 );
+		return 1;
+	}
+	LocalFree( pSid );
+	return 0;
+}
+
+
+static int ownerVerb( wchar_t** argv )
+{
+	// The owner is a SID string (S-1-5-...) or a SDDL alias (BA, SY...)
+	PSID pSid = NULL;
+	if (! ConvertStringSidToSid( argv[ 1 ], &pSid )) {
+		printError( L"Invalid owner SID", GetLastError(), 0 );
+		return 1;
+	}
+
+	int errCode = setOwner( argv[ 0 ], pSid );
+	LocalFree( pSid );
+	return errCode;
+}
+
+
+static int checkDaclVerb( wchar_t** argv )
+{
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	if (! ConvertStringSecurityDescriptorToSecurityDescriptor( argv[ 1 ],
+		SDDL_REVISION_1, &pSD, NULL )) {
+		printError( L"Invalid SDDL string", GetLastError(), 0 );
+		return 1;
+	}
+	LocalFree( pSD );
+	return 0;
+}
+
+
+static int daclVerb( wchar_t** argv )
+{
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	if (! ConvertStringSecurityDescriptorToSecurityDescriptor( argv[ 1 ],
+		SDDL_REVISION_1, &pSD, NULL )) {
+		printError( L"Invalid SDDL string", GetLastError(), 0 );
+		return 1;
+	}
+
+	int errCode = 0;
+	PACL pDacl = NULL;
+	BOOL bDaclPresent = FALSE, bDaclDefaulted = FALSE;
+	SECURITY_DESCRIPTOR_CONTROL control = 0;
+	DWORD dwRevision;
+	if (GetSecurityDescriptorDacl( pSD, &bDaclPresent, &pDacl, &bDaclDefaulted ) &&
+		bDaclPresent &&
+		GetSecurityDescriptorControl( pSD, &control, &dwRevision )) {
+		// "D:P(...)" protects the DACL against inheritance, "D:(...)" does not
+		SECURITY_INFORMATION secInfo = DACL_SECURITY_INFORMATION |
+			((control & SE_DACL_PROTECTED) ?
+				PROTECTED_DACL_SECURITY_INFORMATION :
+				UNPROTECTED_DACL_SECURITY_INFORMATION);
+
+		DWORD dwResult = SetNamedSecurityInfo( argv[ 0 ], SE_FILE_OBJECT, secInfo,
+			NULL, NULL, pDacl, NULL );
+		if (dwResult != ERROR_SUCCESS) {
+			printError( L"Failed to set DACL", dwResult, 0 );
+			errCode = 7;
+		}
+	}
+	else {
+		printError( L"The SDDL string contains no DACL", 0, 0 );
+		errCode = 1;
+	}
+
+	LocalFree( pSD );
+	return errCode;
+}
+
+
+static const VERB fileVerbs[] = {
+	{ L"copy", 2, copyVerb },
+	{ L"move", 2, moveVerb },
+	{ L"rename", 2, renameVerb, checkRenameVerb },
+	{ L"delete", 1, deleteVerb },
+	{ L"takeown", 1, takeownVerb },
+	{ L"owner", 2, ownerVerb, checkOwnerVerb },
+	{ L"dacl", 2, daclVerb, checkDaclVerb }
+};
+
+
+int runFileCommand( int argc, wchar_t** argv )
+{
+	return runVerbs( fileVerbs, sizeof( fileVerbs ) / sizeof( *fileVerbs ), argc, argv );
+}
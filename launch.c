@@ -0,0 +1,606 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	launch.c
+
+	Non-blocking launch engine
+
+	A launch goes through these states:
+		1. Waiting for the TrustedInstaller process. The service is started by a
+		   single work item, shared by all the launches queued in the meantime,
+		   and polled again by a thread-pool timer until its process can be
+		   opened. NotifyServiceStatusChange does not fit a thread pool: it
+		   notifies with an APC to the registering thread, which must wait in
+		   an alertable state. The process handle is then cached until the
+		   process exits (which is detected by a thread-pool wait).
+		2. Creating the child process (work item).
+		3. Waiting for the child to exit or for the timeout (thread-pool wait).
+	No thread is ever blocked by a launch, and the number of launches in flight
+	is not limited by the number of threads or of wait handles. The failed
+	attempts of a step are retried by thread-pool timers, not by sleeping.
+
+*/
+
+#include <windows.h>
+
+#include "utils.h"  // Utility functions
+#include "tokens.h" // Tokens and privileges management functions
+#include "log.h"    // Leveled logging
+#include "retry.h"  // Retry of the operations failing with transient errors
+#include "launch.h"
+
+// Default maximum number of threads of the pool
+#define LAUNCH_MAX_THREADS 4
+
+typedef struct LAUNCH {
+	struct LAUNCH* pPrev;       // Launches in flight (engine.pLaunches)
+	struct LAUNCH* pNext;
+	struct LAUNCH* pNextWaiter; // Launches waiting for the TrustedInstaller process
+	LAUNCH_PARAMS params;
+	wchar_t* pwszCommandLine;   // Writable copy of the command line
+	LAUNCH_CALLBACK pfnCallback;
+	void* pContext;
+	HANDLE hBaseProcess;        // TrustedInstaller process
+	PTP_WAIT pWait;             // Wait for the child process
+	PTP_TIMER pTimer;           // Delay before a new attempt to create the child
+	RETRY_STATE retry;          // Creation of the child process
+	RETRY_STATE tokenRetry;     // System and child process tokens
+	LAUNCH_RESULT result;
+} LAUNCH;
+
+static struct {
+	PTP_POOL pPool;
+	PTP_CLEANUP_GROUP pCleanupGroup;
+	TP_CALLBACK_ENVIRON callbackEnviron;
+	CRITICAL_SECTION lock;      // Protects all the following members
+	LAUNCH* pLaunches;          // Launches in flight
+	LAUNCH* pTIWaiters;         // Launches waiting for the TrustedInstaller process
+	BOOL bTIPending;            // The TrustedInstaller process is being acquired
+	RETRY_STATE tiRetry;        // Acquisition of the TrustedInstaller process
+	HANDLE hTIProcess;          // Cached TrustedInstaller process handle
+	PTP_WAIT pTIWait;           // Wait for the TrustedInstaller process exit
+	PTP_TIMER pTITimer;         // Delay before a new attempt to acquire it
+	BOOL bShutdown;
+
+	// System impersonation token (seamless mode), published without the lock
+	HANDLE volatile hSystemToken;
+} engine = {0};
+
+
+static void queueLaunch( LAUNCH* pLaunch );
+
+
+static void setRelativeTime( FILETIME* pTime, DWORD dwMilliseconds )
+{
+	// Relative time, in 100-nanosecond intervals
+	ULARGE_INTEGER dueTime;
+	dueTime.QuadPart = (ULONGLONG) -((LONGLONG) dwMilliseconds * 10000);
+	pTime->dwLowDateTime = dueTime.LowPart;
+	pTime->dwHighDateTime = dueTime.HighPart;
+}
+
+
+static void freeLaunch( LAUNCH* pLaunch )
+{
+	if (pLaunch->hBaseProcess) CloseHandle( pLaunch->hBaseProcess );
+	if (pLaunch->pwszCommandLine) freeHeap( pLaunch->pwszCommandLine );
+	freeHeap( pLaunch );
+}
+
+
+//
+// Notify the end of a launch, then free it with its process handle.
+// Once the engine is shut down, the launch is freed by launchShutdown.
+//
+static void completeLaunch( LAUNCH* pLaunch )
+{
+	pLaunch->pfnCallback( LAUNCH_EVENT_COMPLETED, &pLaunch->result, pLaunch->pContext );
+	if (pLaunch->result.hProcess) {
+		CloseHandle( pLaunch->result.hProcess );
+		pLaunch->result.hProcess = NULL;
+	}
+
+	EnterCriticalSection( &engine.lock );
+	BOOL bFree = ! engine.bShutdown;
+	if (bFree) {
+		if (pLaunch->pWait) CloseThreadpoolWait( pLaunch->pWait );
+		if (pLaunch->pTimer) CloseThreadpoolTimer( pLaunch->pTimer );
+		if (pLaunch->pPrev) pLaunch->pPrev->pNext = pLaunch->pNext;
+		else engine.pLaunches = pLaunch->pNext;
+		if (pLaunch->pNext) pLaunch->pNext->pPrev = pLaunch->pPrev;
+	}
+	LeaveCriticalSection( &engine.lock );
+
+	if (bFree) freeLaunch( pLaunch );
+}
+
+
+static VOID CALLBACK childWaitCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter, PTP_WAIT pWait, TP_WAIT_RESULT waitResult )
+{
+	LAUNCH* pLaunch = pParameter;
+
+	if (waitResult == WAIT_TIMEOUT) {
+		logDebug( L"Process %lu did not exit before the timeout",
+			pLaunch->result.dwProcessId );
+		pLaunch->result.bTimedOut = TRUE;
+		pLaunch->result.errCode = 6;
+	}
+	else {
+		// Get exit code of child process
+		if (GetExitCodeProcess( pLaunch->result.hProcess, &pLaunch->result.dwExitCode )) {
+			logDebug( L"Process exited with code %ld",
+				pLaunch->result.dwExitCode );
+		}
+		else pLaunch->result.errCode = 6;
+	}
+
+	completeLaunch( pLaunch );
+}
+
+
+static VOID CALLBACK retryTimerCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter, PTP_TIMER pTimer )
+{
+	queueLaunch( pParameter );
+}
+
+
+//
+// Create the child process of a launch, then wait for it to exit.
+//
+static VOID CALLBACK createChildCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter )
+{
+	LAUNCH* pLaunch = pParameter;
+	int errCode = 0;
+	HANDLE hChildProcessToken = NULL;
+	DWORD dwRetryDelay = INFINITE;
+
+	// Failure that is retried later: its message and error code, if the retries
+	// are exhausted or cannot be scheduled
+	const wchar_t* pcwszFailure = NULL;
+	DWORD dwFailureError = 0;
+	int iFailureStep = 0, failureErrCode = 0;
+
+	if (pLaunch->params.bSeamless) {
+		// CreateProcessAsUser requires SeAssignPrimaryToken, which is held by
+		// the system token. It is got once for all the launches, outside the
+		// engine lock: if several launches get it at once, the first one
+		// published is kept.
+		HANDLE hSystemToken = engine.hSystemToken;
+		if (! hSystemToken) {
+			dwFailureError = openSystemToken( &hSystemToken, &iFailureStep );
+			if (! dwFailureError && InterlockedCompareExchangePointer(
+				(PVOID volatile*) &engine.hSystemToken, hSystemToken, NULL )) {
+				CloseHandle( hSystemToken );
+				hSystemToken = engine.hSystemToken;
+			}
+		}
+		if (! dwFailureError && ! SetThreadToken( NULL, hSystemToken )) {
+			dwFailureError = GetLastError();
+			iFailureStep = 6;
+		}
+		if (dwFailureError) {
+			pcwszFailure = L"Failed to create system context";
+			pLaunch->tokenRetry.hProcess = NULL;
+		}
+		else {
+			// Create the child process token
+			dwFailureError = openChildProcessToken( pLaunch->hBaseProcess,
+				&hChildProcessToken, &iFailureStep );
+			if (dwFailureError) {
+				pcwszFailure = L"Failed to create child process token";
+				pLaunch->tokenRetry.hProcess = pLaunch->hBaseProcess;
+			}
+		}
+
+		if (dwFailureError) {
+			failureErrCode = 5;
+			dwRetryDelay = retryDelay( &pLaunch->tokenRetry, dwFailureError );
+			if (dwRetryDelay == INFINITE) {
+				printError( pcwszFailure, dwFailureError, iFailureStep );
+				errCode = failureErrCode;
+			}
+		}
+		else {
+			// Get the console session id and set it in the token
+			DWORD dwSessionId = WTSGetActiveConsoleSessionId();
+			if (dwSessionId != (DWORD) -1) {
+				SetTokenInformation( hChildProcessToken, TokenSessionId, (PVOID) &dwSessionId,
+					sizeof( DWORD ) );
+			}
+
+			// Set the privileges of the profile in the child process token
+			setPrivileges( hChildProcessToken, pLaunch->params.privileges,
+				pLaunch->params.bRemovePrivileges );
+		}
+	}
+
+	PROCESS_INFORMATION processInfo = {0};
+
+	if (! errCode && dwRetryDelay == INFINITE) {
+		// Initialize startupInfo
+
+		STARTUPINFOEX startupInfo = {0};
+
+		startupInfo.StartupInfo.cb = sizeof( STARTUPINFOEX );
+		startupInfo.StartupInfo.dwFlags = STARTF_USESHOWWINDOW;
+		if (pLaunch->params.bMinimize)
+			startupInfo.StartupInfo.wShowWindow = SW_SHOWMINNOACTIVE;
+		else
+			startupInfo.StartupInfo.wShowWindow = SW_SHOWNORMAL;
+
+		if (! pLaunch->params.bSeamless) {
+			// Initialize attribute lists for "parent assignment"
+
+			SIZE_T attributeListLength = 0;
+			InitializeProcThreadAttributeList( NULL, 1, 0, (PSIZE_T) &attributeListLength );
+			startupInfo.lpAttributeList = allocHeap( HEAP_ZERO_MEMORY, attributeListLength );
+			InitializeProcThreadAttributeList( startupInfo.lpAttributeList, 1, 0,
+				(PSIZE_T) &attributeListLength );
+
+			UpdateProcThreadAttribute( startupInfo.lpAttributeList, 0,
+				PROC_THREAD_ATTRIBUTE_PARENT_PROCESS, &pLaunch->hBaseProcess, sizeof( HANDLE ),
+				NULL, NULL );
+		}
+
+		// Create process
+
+		DWORD dwCreationFlags = 0;
+		if (! pLaunch->params.bSeamless)
+			dwCreationFlags = CREATE_SUSPENDED | EXTENDED_STARTUPINFO_PRESENT |
+			CREATE_NEW_CONSOLE;
+		if (pLaunch->params.pcwszEnvironment) dwCreationFlags |= CREATE_UNICODE_ENVIRONMENT;
+
+		logDebug( L"Creating specified process" );
+
+		BOOL bCreateResult = traceCall( CreateProcessAsUser, (
+			hChildProcessToken,
+			pLaunch->params.pcwszApplicationName,
+			pLaunch->pwszCommandLine,
+			NULL,
+			NULL,
+			FALSE,
+			dwCreationFlags,
+			(LPVOID) pLaunch->params.pcwszEnvironment,
+			pLaunch->params.pcwszCurrentDirectory,
+			(LPSTARTUPINFO) &startupInfo,
+			&processInfo
+		) );
+
+		DWORD dwCreateError = bCreateResult ? 0 : GetLastError();
+
+		if (! pLaunch->params.bSeamless) {
+			DeleteProcThreadAttributeList( startupInfo.lpAttributeList );
+			freeHeap( startupInfo.lpAttributeList );
+		}
+
+		if (bCreateResult) {
+			// The command line is no longer needed while waiting
+			freeHeap( pLaunch->pwszCommandLine );
+			pLaunch->pwszCommandLine = NULL;
+			pLaunch->params.pcwszCommandLine = NULL;
+			pLaunch->params.pcwszApplicationName = NULL;
+			pLaunch->params.pcwszEnvironment = NULL;
+			pLaunch->params.pcwszCurrentDirectory = NULL;
+		}
+		else {
+			pcwszFailure = L"Process creation failed";
+			dwFailureError = dwCreateError;
+			iFailureStep = 0;
+			failureErrCode = 4;
+			pLaunch->retry.hProcess = pLaunch->hBaseProcess;
+			dwRetryDelay = retryDelay( &pLaunch->retry, dwCreateError );
+			if (dwRetryDelay == INFINITE) {
+				// Most commonly - 0x2 - The system cannot find the file specified.
+				printError( pcwszFailure, dwCreateError, 0 );
+				errCode = 4;
+			}
+		}
+	}
+
+	if (hChildProcessToken) CloseHandle( hChildProcessToken );
+	if (pLaunch->params.bSeamless) SetThreadToken( NULL, NULL );
+	CloseHandle( pLaunch->hBaseProcess );
+	pLaunch->hBaseProcess = NULL;
+
+	if (dwRetryDelay != INFINITE) {
+		// Try again later. The TrustedInstaller process is acquired again,
+		// in case it has exited in the meantime.
+		if (! pLaunch->pTimer)
+			pLaunch->pTimer = CreateThreadpoolTimer( retryTimerCallback, pLaunch,
+				&engine.callbackEnviron );
+		if (pLaunch->pTimer) {
+			FILETIME dueTime;
+			setRelativeTime( &dueTime, dwRetryDelay );
+			SetThreadpoolTimer( pLaunch->pTimer, &dueTime, 0, 0 );
+			return;
+		}
+		printError( pcwszFailure, dwFailureError, iFailureStep );
+		errCode = failureErrCode;
+	}
+
+	if (errCode) {
+		pLaunch->result.errCode = errCode;
+		completeLaunch( pLaunch );
+		return;
+	}
+
+	if (! pLaunch->params.bSeamless) {
+		HANDLE hProcessToken = NULL;
+		OpenProcessToken( processInfo.hProcess, TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+			&hProcessToken );
+		// Set the privileges of the profile in the child process token
+		setPrivileges( hProcessToken, pLaunch->params.privileges,
+			pLaunch->params.bRemovePrivileges );
+		CloseHandle( hProcessToken );
+
+		ResumeThread( processInfo.hThread );
+	}
+	CloseHandle( processInfo.hThread );
+
+	logDebug( L"Created process ID: %lu", processInfo.dwProcessId );
+
+	pLaunch->result.dwProcessId = processInfo.dwProcessId;
+	pLaunch->result.hProcess = processInfo.hProcess;
+	pLaunch->pfnCallback( LAUNCH_EVENT_CREATED, &pLaunch->result, pLaunch->pContext );
+
+	if (pLaunch->params.bWait) {
+		pLaunch->pWait = CreateThreadpoolWait( childWaitCallback, pLaunch,
+			&engine.callbackEnviron );
+		if (pLaunch->pWait) {
+			logDebug( L"Waiting for process to exit" );
+
+			FILETIME timeout, *pTimeout = NULL;
+			if (pLaunch->params.dwTimeout != INFINITE) {
+				setRelativeTime( &timeout, pLaunch->params.dwTimeout );
+				pTimeout = &timeout;
+			}
+			SetThreadpoolWait( pLaunch->pWait, processInfo.hProcess, pTimeout );
+			return;
+		}
+		printError( L"Failed to wait for process", GetLastError(), 0 );
+		pLaunch->result.errCode = 6;
+	}
+
+	completeLaunch( pLaunch );
+}
+
+
+static VOID CALLBACK failLaunchCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter )
+{
+	completeLaunch( pParameter );
+}
+
+
+static void submitLaunch( LAUNCH* pLaunch, int errCode )
+{
+	if (! errCode) {
+		if (TrySubmitThreadpoolCallback( createChildCallback, pLaunch,
+			&engine.callbackEnviron )) return;
+		printError( L"Failed to submit launch", GetLastError(), 0 );
+		errCode = 5;
+	}
+
+	// A failure is notified from the pool too: this may be the thread calling
+	// launchStart. Only if the pool cannot take any work item, it is notified
+	// at once.
+	pLaunch->result.errCode = errCode;
+	if (! TrySubmitThreadpoolCallback( failLaunchCallback, pLaunch,
+		&engine.callbackEnviron ))
+		completeLaunch( pLaunch );
+}
+
+
+//
+// Give each launch its own handle to the TrustedInstaller process.
+// Called with the engine lock held.
+//
+static int shareTIProcess( LAUNCH* pLaunch )
+{
+	if (! traceCall( DuplicateHandle, ( GetCurrentProcess(), engine.hTIProcess,
+		GetCurrentProcess(), &pLaunch->hBaseProcess, 0, FALSE, DUPLICATE_SAME_ACCESS ) )) {
+		pLaunch->hBaseProcess = NULL;
+		printError( L"Failed to open TrustedInstaller process", GetLastError(), 0 );
+		return 3;
+	}
+	return 0;
+}
+
+
+static VOID CALLBACK acquireTIProcessCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter )
+{
+	// Start the TrustedInstaller service and get its process handle
+	HANDLE hTIProcess = NULL;
+	int iStep, errCode = 0;
+	DWORD dwLastError = openTrustedInstallerProcess( &hTIProcess, &iStep );
+	if (dwLastError) {
+		// Try again later: the waiters stay queued
+		DWORD dwRetryDelay = retryDelay( &engine.tiRetry, dwLastError );
+		if (dwRetryDelay != INFINITE) {
+			FILETIME dueTime;
+			setRelativeTime( &dueTime, dwRetryDelay );
+			SetThreadpoolTimer( engine.pTITimer, &dueTime, 0, 0 );
+			return;
+		}
+		printError( L"Failed to open TrustedInstaller process", dwLastError, iStep );
+		errCode = 3;
+	}
+
+	EnterCriticalSection( &engine.lock );
+	if (! errCode) {
+		engine.hTIProcess = hTIProcess;
+		// Forget the handle when the service stops
+		SetThreadpoolWait( engine.pTIWait, hTIProcess, NULL );
+	}
+	LAUNCH* pWaiters = engine.pTIWaiters;
+	engine.pTIWaiters = NULL;
+	engine.bTIPending = FALSE;
+	for (LAUNCH* pLaunch = pWaiters; pLaunch; pLaunch = pLaunch->pNextWaiter)
+		pLaunch->result.errCode = errCode ? errCode : shareTIProcess( pLaunch );
+	LeaveCriticalSection( &engine.lock );
+
+	while (pWaiters) {
+		LAUNCH* pLaunch = pWaiters;
+		pWaiters = pLaunch->pNextWaiter;
+		submitLaunch( pLaunch, pLaunch->result.errCode );
+	}
+}
+
+
+static VOID CALLBACK tiRetryTimerCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter, PTP_TIMER pTimer )
+{
+	acquireTIProcessCallback( pInstance, pParameter );
+}
+
+
+static VOID CALLBACK tiExitCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter, PTP_WAIT pWait, TP_WAIT_RESULT waitResult )
+{
+	// The next launch restarts the service
+	EnterCriticalSection( &engine.lock );
+	if (engine.hTIProcess) CloseHandle( engine.hTIProcess );
+	engine.hTIProcess = NULL;
+	LeaveCriticalSection( &engine.lock );
+}
+
+
+int launchInitialize( DWORD nMaxThreads )
+{
+	InitializeCriticalSection( &engine.lock );
+	InitializeThreadpoolEnvironment( &engine.callbackEnviron );
+
+	DWORD dwLastError = 0;
+	engine.pPool = CreateThreadpool( NULL );
+	if (engine.pPool) {
+		SetThreadpoolThreadMaximum( engine.pPool,
+			nMaxThreads ? nMaxThreads : LAUNCH_MAX_THREADS );
+		SetThreadpoolCallbackPool( &engine.callbackEnviron, engine.pPool );
+
+		engine.pCleanupGroup = CreateThreadpoolCleanupGroup();
+		if (engine.pCleanupGroup) {
+			SetThreadpoolCallbackCleanupGroup( &engine.callbackEnviron,
+				engine.pCleanupGroup, NULL );
+			engine.pTIWait = CreateThreadpoolWait( tiExitCallback, NULL,
+				&engine.callbackEnviron );
+			engine.pTITimer = CreateThreadpoolTimer( tiRetryTimerCallback, NULL,
+				&engine.callbackEnviron );
+		}
+	}
+	if (! engine.pTIWait || ! engine.pTITimer) dwLastError = GetLastError();
+
+	if (dwLastError) {
+		printError( L"Failed to create thread pool", dwLastError, 0 );
+		launchShutdown();
+		return 5;
+	}
+
+	return 0;
+}
+
+
+//
+// Queue a launch for the creation of its child process, as soon as the
+// TrustedInstaller process is available.
+//
+static void queueLaunch( LAUNCH* pLaunch )
+{
+	int errCode = 0;
+	BOOL bAcquire = FALSE, bReady = FALSE;
+
+	EnterCriticalSection( &engine.lock );
+	if (engine.hTIProcess) {
+		errCode = shareTIProcess( pLaunch );
+		bReady = ! errCode;
+	}
+	else {
+		// Wait for the TrustedInstaller process
+		pLaunch->pNextWaiter = engine.pTIWaiters;
+		engine.pTIWaiters = pLaunch;
+		bAcquire = ! engine.bTIPending;
+		engine.bTIPending = TRUE;
+		if (bAcquire) retryBegin( &engine.tiRetry, RETRY_SERVICE );
+	}
+	LeaveCriticalSection( &engine.lock );
+
+	if (errCode || bReady) submitLaunch( pLaunch, errCode );
+	else if (bAcquire && ! TrySubmitThreadpoolCallback( acquireTIProcessCallback, NULL,
+		&engine.callbackEnviron )) {
+		printError( L"Failed to submit launch", GetLastError(), 0 );
+		// Fail all the waiters
+		EnterCriticalSection( &engine.lock );
+		LAUNCH* pWaiters = engine.pTIWaiters;
+		engine.pTIWaiters = NULL;
+		engine.bTIPending = FALSE;
+		LeaveCriticalSection( &engine.lock );
+		while (pWaiters) {
+			LAUNCH* pWaiter = pWaiters;
+			pWaiters = pWaiter->pNextWaiter;
+			submitLaunch( pWaiter, 5 );
+		}
+	}
+}
+
+
+int launchStart( const LAUNCH_PARAMS* pParams, LAUNCH_CALLBACK pfnCallback,
+	void* pContext )
+{
+	LAUNCH* pLaunch = allocHeap( HEAP_ZERO_MEMORY, sizeof( LAUNCH ) );
+	pLaunch->params = *pParams;
+	pLaunch->pfnCallback = pfnCallback;
+	pLaunch->pContext = pContext;
+	retryBegin( &pLaunch->retry, RETRY_CREATE );
+	retryBegin( &pLaunch->tokenRetry, RETRY_TOKEN );
+
+	// The command line may be read-only. It must be copied to a writable area.
+	size_t nCommandLineBufSize = (wcslen( pParams->pcwszCommandLine ) + 1) *
+		sizeof( wchar_t );
+	pLaunch->pwszCommandLine = allocHeap( 0, nCommandLineBufSize );
+	memcpy( pLaunch->pwszCommandLine, pParams->pcwszCommandLine, nCommandLineBufSize );
+	pLaunch->params.pcwszCommandLine = pLaunch->pwszCommandLine;
+
+	EnterCriticalSection( &engine.lock );
+	pLaunch->pNext = engine.pLaunches;
+	if (pLaunch->pNext) pLaunch->pNext->pPrev = pLaunch;
+	engine.pLaunches = pLaunch;
+	LeaveCriticalSection( &engine.lock );
+
+	queueLaunch( pLaunch );
+	return 0;
+}
+
+
+void launchShutdown( void )
+{
+	EnterCriticalSection( &engine.lock );
+	engine.bShutdown = TRUE;
+	LeaveCriticalSection( &engine.lock );
+
+	// Wait for the running callbacks, then cancel and release the pending
+	// work items and waits
+	if (engine.pCleanupGroup) {
+		CloseThreadpoolCleanupGroupMembers( engine.pCleanupGroup, TRUE, NULL );
+		CloseThreadpoolCleanupGroup( engine.pCleanupGroup );
+	}
+	if (engine.pPool) CloseThreadpool( engine.pPool );
+	DestroyThreadpoolEnvironment( &engine.callbackEnviron );
+
+	// Free the launches still in flight
+	while (engine.pLaunches) {
+		LAUNCH* pLaunch = engine.pLaunches;
+		engine.pLaunches = pLaunch->pNext;
+		if (pLaunch->result.hProcess) CloseHandle( pLaunch->result.hProcess );
+		freeLaunch( pLaunch );
+	}
+
+	if (engine.hTIProcess) CloseHandle( engine.hTIProcess );
+	if (engine.hSystemToken) CloseHandle( engine.hSystemToken );
+	DeleteCriticalSection( &engine.lock );
+	ZeroMemory( &engine, sizeof( engine ) );
+}
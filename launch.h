@@ -0,0 +1,63 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	launch.h
+
+	Non-blocking launch engine
+
+	Each launch is a state machine driven by a small thread pool: its waits
+	(TrustedInstaller process, child exit, timeout) are thread-pool wait
+	objects, so that any number of launches can be in flight at once.
+
+*/
+
+// Launch parameters
+typedef struct {
+	const wchar_t* pcwszCommandLine;  // Command to run
+	const wchar_t* pcwszApplicationName; // Image to run (valid until the launch is
+	                                     // created), or NULL to take it from the command
+	const wchar_t* pcwszEnvironment;  // Environment block of the child (valid until the launch
+	                                  // is created), or NULL to inherit the environment
+	const wchar_t* pcwszCurrentDirectory; // Full path of the current directory of the child
+	                                      // (valid until the launch is created), or NULL
+	DWORD dwTimeout;                  // Timeout of the wait for the child (ms), or INFINITE
+	ULONGLONG privileges;             // Privileges enabled in the child token (PRIVILEGE_BIT)
+	unsigned int bMinimize : 1;       // Minimize the created window
+	unsigned int bSeamless : 1;       // The child shares the console of this process
+	unsigned int bWait : 1;           // Wait for the child to exit
+	unsigned int bRemovePrivileges : 1; // Remove the other privileges from the child token
+} LAUNCH_PARAMS;
+
+// Launch events, notified to the launch callback
+#define LAUNCH_EVENT_CREATED 1    // The child process is created (not sent on failure)
+#define LAUNCH_EVENT_COMPLETED 2  // The launch is complete (the last event)
+
+typedef struct {
+	int errCode;          // superUser error code, 0 if success
+	DWORD dwProcessId;    // Id of the child process
+	DWORD dwExitCode;     // Exit code of the child (if bWait)
+	BOOL bTimedOut;       // The child did not exit before the timeout (if bWait)
+	HANDLE hProcess;      // Child process handle, only valid during the callback
+} LAUNCH_RESULT;
+
+// Called on a thread-pool thread. The callbacks of a launch never overlap.
+// Exception: if the pool cannot queue any work item (out of memory), the
+// failure of a launch is notified synchronously, possibly by launchStart on the
+// thread of its caller.
+typedef void (*LAUNCH_CALLBACK)( int iEvent, const LAUNCH_RESULT* pResult,
+	void* pContext );
+
+// Create the thread pool. nMaxThreads is 0 for the default.
+int launchInitialize( DWORD nMaxThreads );
+
+// Start a launch. Its result is notified to the callback.
+// Return 0, or a superUser error code if the launch could not be started.
+int launchStart( const LAUNCH_PARAMS* pParams, LAUNCH_CALLBACK pfnCallback,
+	void* pContext );
+
+// Wait for the running callbacks, cancel the pending waits, free the pool and
+// close the cached TrustedInstaller process handle and system token.
+void launchShutdown( void );
@@ -0,0 +1,210 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	log.c
+
+	Leveled logging
+
+	Console: errors are written to standard error output, the other messages
+	to standard output (or standard error output too, when standard output
+	carries data). The debug and trace messages are prefixed with their
+	timestamp (seconds since the start).
+
+	Log file: all the messages, with their timestamp, level and thread id.
+	They are buffered and written in large batches: when the buffer is full,
+	and when the log is flushed or closed.
+
+*/
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+// Longest line written to the log file (in characters)
+#define LOG_LINE_MAX 4096
+
+int iLogLevel = LOG_INFO;
+
+static const wchar_t acLevelTags[] = L"EIDT";
+
+static struct {
+	LARGE_INTEGER start;
+	LARGE_INTEGER frequency;
+	DWORD dwTraceTls;         // Start of the traced call (performance counter)
+	BOOL bStandardError;      // All the console messages to standard error output
+	HANDLE hFile;
+	CRITICAL_SECTION lock;    // Protects the buffer
+	char* pBuffer;
+	DWORD nBuffered;
+} logState = { .dwTraceTls = TLS_OUT_OF_INDEXES };
+
+
+// Time elapsed since the start, in microseconds
+static ULONGLONG getTimestamp( void )
+{
+	if (! logState.frequency.QuadPart) return 0;  // Not initialized
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	ULONGLONG nTicks = now.QuadPart - logState.start.QuadPart;
+	ULONGLONG nFrequency = logState.frequency.QuadPart;
+	return nTicks / nFrequency * 1000000 + nTicks % nFrequency * 1000000 / nFrequency;
+}
+
+
+void logInitialize( int iLevel )
+{
+	iLogLevel = iLevel;
+	QueryPerformanceFrequency( &logState.frequency );
+	QueryPerformanceCounter( &logState.start );
+#if LOG_MAX_LEVEL >= LOG_TRACE
+	if (iLevel >= LOG_TRACE) logState.dwTraceTls = TlsAlloc();
+#endif
+}
+
+
+int logOpenFile( const wchar_t* pcwszPath )
+{
+	// Several instances can share the same log file
+	logState.hFile = CreateFile( pcwszPath, FILE_APPEND_DATA,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (logState.hFile == INVALID_HANDLE_VALUE) {
+		logState.hFile = NULL;
+		printError( L"Failed to open log file", GetLastError(), 0 );
+		return 1;
+	}
+
+	InitializeCriticalSection( &logState.lock );
+	logState.pBuffer = allocHeap( 0, LOG_BUFFER_SIZE );
+	logState.nBuffered = 0;
+	return 0;
+}
+
+
+// Called with the lock held
+static void writeBuffer( void )
+{
+	if (logState.nBuffered) {
+		DWORD nWritten;
+		WriteFile( logState.hFile, logState.pBuffer, logState.nBuffered, &nWritten, NULL );
+		logState.nBuffered = 0;
+	}
+}
+
+
+void logToStandardError( void )
+{
+	logState.bStandardError = TRUE;
+}
+
+
+void logFlush( void )
+{
+	if (! logState.hFile) return;
+	EnterCriticalSection( &logState.lock );
+	writeBuffer();
+	LeaveCriticalSection( &logState.lock );
+}
+
+
+void logShutdown( void )
+{
+	if (! logState.hFile) return;
+	logFlush();
+	CloseHandle( logState.hFile );
+	logState.hFile = NULL;
+	freeHeap( logState.pBuffer );
+	DeleteCriticalSection( &logState.lock );
+}
+
+
+static void writeFile( int iLevel, ULONGLONG timestamp, const wchar_t* pcwszMessage )
+{
+	wchar_t wszLine[ LOG_LINE_MAX ];
+	int nLen = _snwprintf_s( wszLine, LOG_LINE_MAX, _TRUNCATE, L"%lu.%06lu [%lc] %5lu %ls\r\n",
+		(DWORD) (timestamp / 1000000), (DWORD) (timestamp % 1000000), acLevelTags[ iLevel ],
+		GetCurrentThreadId(), pcwszMessage );
+	if (nLen < 0) {
+		// Truncated
+		nLen = LOG_LINE_MAX - 1;
+		wszLine[ nLen - 2 ] = L'\r';
+		wszLine[ nLen - 1 ] = L'\n';
+	}
+
+	EnterCriticalSection( &logState.lock );
+	if (logState.nBuffered + LOG_LINE_MAX * 3 > LOG_BUFFER_SIZE) writeBuffer();
+	int nSize = WideCharToMultiByte( CP_UTF8, 0, wszLine, nLen,
+		logState.pBuffer + logState.nBuffered, LOG_BUFFER_SIZE - logState.nBuffered,
+		NULL, NULL );
+	logState.nBuffered += nSize;
+	LeaveCriticalSection( &logState.lock );
+}
+
+
+void logWrite( int iLevel, const wchar_t* pcwszFormat, ... )
+{
+	ULONGLONG timestamp = getTimestamp();
+
+	va_list args;
+	va_start( args, pcwszFormat );
+	int nLen = _vscwprintf( pcwszFormat, args );
+	va_end( args );
+	if (nLen < 0) return;
+	SIZE_T nSize = (SIZE_T) nLen + 1;
+	wchar_t* pMessage = allocHeap( 0, nSize * sizeof( wchar_t ) );
+	va_start( args, pcwszFormat );
+	_vsnwprintf_s( pMessage, nSize, _TRUNCATE, pcwszFormat, args );
+	va_end( args );
+
+	BOOL (*pfnPrint)( const wchar_t*, ... ) = (iLevel == LOG_ERROR ||
+		logState.bStandardError) ? printFmtConsoleError : printFmtConsole;
+	if (iLevel <= LOG_INFO)
+		pfnPrint( L"[%lc] %ls\n", acLevelTags[ iLevel ], pMessage );
+	else
+		pfnPrint( L"[%lc] %lu.%06lu %ls\n", acLevelTags[ iLevel ],
+			(DWORD) (timestamp / 1000000), (DWORD) (timestamp % 1000000), pMessage );
+
+	if (logState.hFile) {
+		writeFile( iLevel, timestamp, pMessage );
+		// Do not lose an error if the program ends abruptly
+		if (iLevel == LOG_ERROR) logFlush();
+	}
+
+	freeHeap( pMessage );
+}
+
+
+void logTraceBegin( void )
+{
+	if (iLogLevel < LOG_TRACE || logState.dwTraceTls == TLS_OUT_OF_INDEXES) return;
+	DWORD dwLastError = GetLastError();
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	// The low part is enough to measure a call
+	TlsSetValue( logState.dwTraceTls, (LPVOID) (ULONG_PTR) now.LowPart );
+	SetLastError( dwLastError );
+}
+
+
+ULONG_PTR logTraceEnd( const char* pcszFunction, ULONG_PTR result )
+{
+	if (iLogLevel < LOG_TRACE || logState.dwTraceTls == TLS_OUT_OF_INDEXES) return result;
+
+	DWORD dwLastError = GetLastError();
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	DWORD nTicks = now.LowPart - (DWORD) (ULONG_PTR) TlsGetValue( logState.dwTraceTls );
+	DWORD dwMicroseconds = (DWORD) ((ULONGLONG) nTicks * 1000000 /
+		logState.frequency.QuadPart);
+
+	logWrite( LOG_TRACE, L"%hs: %p (last error: 0x%08lX, %lu us)", pcszFunction,
+		(void*) result, dwLastError, dwMicroseconds );
+
+	SetLastError( dwLastError );
+	return result;
+}
@@ -0,0 +1,88 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	log.h
+
+	Leveled logging
+
+	Messages are written to the console and, optionally, to a log file with
+	a monotonic timestamp (in microseconds). The messages above LOG_MAX_LEVEL
+	are removed at build time, arguments included: they cost nothing at run
+	time. The others are written if their level is enabled at run time.
+
+*/
+
+// Levels
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+#define LOG_TRACE 3  // Win32 calls with their result and latency
+
+// Build-time threshold (e.g. make LOG_MAX_LEVEL=3)
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+// Run-time level (LOG_INFO by default)
+extern int iLogLevel;
+
+// Whether a level is enabled, to skip the preparation of its messages
+#define logEnabled( iLevel ) ((iLevel) <= LOG_MAX_LEVEL && (iLevel) <= iLogLevel)
+
+#define logMessage( iLevel, ... ) \
+	do { if ((iLevel) <= iLogLevel) logWrite( (iLevel), __VA_ARGS__ ); } while (0)
+
+#define logError( ... ) logMessage( LOG_ERROR, __VA_ARGS__ )
+
+#if LOG_MAX_LEVEL >= LOG_INFO
+#define logInfo( ... ) logMessage( LOG_INFO, __VA_ARGS__ )
+#else
+#define logInfo( ... ) ((void) 0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_DEBUG
+#define logDebug( ... ) logMessage( LOG_DEBUG, __VA_ARGS__ )
+#else
+#define logDebug( ... ) ((void) 0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_TRACE
+#define logTrace( ... ) logMessage( LOG_TRACE, __VA_ARGS__ )
+
+// Call a Win32 function returning a BOOL (traceCall) or a handle
+// (traceCallHandle) and trace its result, last error and latency.
+// The last error is preserved.
+#define traceCall( fn, args ) \
+	(logTraceBegin(), (BOOL) logTraceEnd( #fn, (ULONG_PTR) (fn args) ))
+#define traceCallHandle( fn, args ) \
+	(logTraceBegin(), (HANDLE) logTraceEnd( #fn, (ULONG_PTR) (fn args) ))
+#else
+#define logTrace( ... ) ((void) 0)
+#define traceCall( fn, args ) (fn args)
+#define traceCallHandle( fn, args ) (fn args)
+#endif
+
+// Set the run-time level and start the clock.
+void logInitialize( int iLevel );
+
+// Also write the messages to a file (appended, in UTF-8).
+int logOpenFile( const wchar_t* pcwszPath );
+
+// Write all the console messages to standard error output (standard output
+// carries data).
+void logToStandardError( void );
+
+// Write the buffered messages to the log file.
+void logFlush( void );
+
+// Flush and close the log file.
+void logShutdown( void );
+
+// Write a message (use the macros above).
+void logWrite( int iLevel, const wchar_t* pcwszFormat, ... );
+
+void logTraceBegin( void );
+ULONG_PTR logTraceEnd( const char* pcszFunction, ULONG_PTR result );
@@ -0,0 +1,274 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	prefetch.c
+
+	Prefetch of the image of the child process
+
+	On a cold system, the child process faults in its image and DLLs only
+	after the TrustedInstaller service is started and the tokens are ready.
+	The prefetch reads them into the file cache meanwhile, on a background
+	thread: each file is mapped and its pages are prefetched in large batches
+	(PrefetchVirtualMemory, Windows 8 and later) or touched in sequence.
+	The DLLs are those imported directly by the image, except the ones already
+	loaded by superUser (they are in memory) and the API sets.
+
+*/
+
+#include <windows.h>
+#include <string.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"   // Leveled logging
+#include "prefetch.h"
+
+// Not declared for Vista targets
+typedef struct {
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} MEMORY_RANGE;
+
+typedef BOOL (WINAPI* PREFETCH_VIRTUAL_MEMORY)( HANDLE hProcess, ULONG_PTR nEntries,
+	MEMORY_RANGE* pRanges, ULONG dwFlags );
+
+#define PAGE_SIZE 4096
+
+static struct {
+	HANDLE hThread;
+	wchar_t* pwszCommandLine;
+	volatile BOOL bStop;
+	PREFETCH_VIRTUAL_MEMORY pfnPrefetchVirtualMemory;
+
+	// Totals
+	int nFiles;
+	ULONGLONG nBytes;
+} prefetch;
+
+
+//
+// Bring the pages of a mapped file into memory.
+//
+static void prefetchView( const BYTE* pView, SIZE_T nSize )
+{
+	if (prefetch.pfnPrefetchVirtualMemory) {
+		MEMORY_RANGE range = { (PVOID) pView, nSize };
+		prefetch.pfnPrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0 );
+	}
+
+	// Without PrefetchVirtualMemory, the pages are read in sequence. Otherwise
+	// the reads are only queued: the pages are touched to wait for them (they
+	// are resident or in transition, no read is issued twice).
+	volatile BYTE nSum = 0;
+	for (SIZE_T i = 0; i < nSize && ! prefetch.bStop; i += PAGE_SIZE) nSum += pView[ i ];
+}
+
+
+//
+// Return the offset in the file of a RVA, or 0 if it is not in a section.
+//
+static DWORD rvaToOffset( const IMAGE_SECTION_HEADER* pSections, WORD nSections,
+	DWORD dwRva, SIZE_T nSize )
+{
+	for (WORD i = 0; i < nSections; i++) {
+		DWORD dwStart = pSections[ i ].VirtualAddress;
+		DWORD dwLength = pSections[ i ].SizeOfRawData;
+		if (dwRva >= dwStart && dwRva - dwStart < dwLength) {
+			DWORD dwOffset = dwRva - dwStart + pSections[ i ].PointerToRawData;
+			return (dwOffset < nSize) ? dwOffset : 0;
+		}
+	}
+	return 0;
+}
+
+
+static void prefetchFile( const wchar_t* pwszPath, const wchar_t* pwszDirectory );
+
+
+//
+// Prefetch the DLLs imported by a mapped image. The view is a data view:
+// the RVAs are converted to file offsets, and everything is bounds-checked.
+//
+static void prefetchImports( const BYTE* pView, SIZE_T nSize, const wchar_t* pwszDirectory )
+{
+	const IMAGE_DOS_HEADER* pDosHeader = (const IMAGE_DOS_HEADER*) pView;
+	if (nSize < sizeof( IMAGE_DOS_HEADER ) || pDosHeader->e_magic != IMAGE_DOS_SIGNATURE ||
+		pDosHeader->e_lfanew < 0 ||
+		(SIZE_T) pDosHeader->e_lfanew + sizeof( IMAGE_NT_HEADERS64 ) > nSize)
+		return;
+
+	const IMAGE_NT_HEADERS32* pNtHeaders32 = (const IMAGE_NT_HEADERS32*)
+		(pView + pDosHeader->e_lfanew);
+	const IMAGE_NT_HEADERS64* pNtHeaders64 = (const IMAGE_NT_HEADERS64*) pNtHeaders32;
+	if (pNtHeaders32->Signature != IMAGE_NT_SIGNATURE) return;
+
+	const IMAGE_DATA_DIRECTORY* pImportDirectory;
+	WORD wMagic = pNtHeaders32->OptionalHeader.Magic;
+	if (wMagic == IMAGE_NT_OPTIONAL_HDR32_MAGIC &&
+		pNtHeaders32->OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_IMPORT)
+		pImportDirectory =
+			&pNtHeaders32->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_IMPORT ];
+	else if (wMagic == IMAGE_NT_OPTIONAL_HDR64_MAGIC &&
+		pNtHeaders64->OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_IMPORT)
+		pImportDirectory =
+			&pNtHeaders64->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_IMPORT ];
+	else return;
+
+	// The section headers follow the optional header (same offset for both formats)
+	WORD nSections = pNtHeaders32->FileHeader.NumberOfSections;
+	SIZE_T nSectionsOffset = (SIZE_T) pDosHeader->e_lfanew +
+		FIELD_OFFSET( IMAGE_NT_HEADERS32, OptionalHeader ) +
+		pNtHeaders32->FileHeader.SizeOfOptionalHeader;
+	if (nSectionsOffset + (SIZE_T) nSections * sizeof( IMAGE_SECTION_HEADER ) > nSize) return;
+	const IMAGE_SECTION_HEADER* pSections = (const IMAGE_SECTION_HEADER*)
+		(pView + nSectionsOffset);
+
+	DWORD dwOffset = rvaToOffset( pSections, nSections, pImportDirectory->VirtualAddress,
+		nSize );
+	if (! dwOffset) return;
+
+	// Images in long-path directories: the buffers are not limited to MAX_PATH
+	wchar_t* pwszName = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+	wchar_t* pwszPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+	for (const IMAGE_IMPORT_DESCRIPTOR* pDescriptor =
+		(const IMAGE_IMPORT_DESCRIPTOR*) (pView + dwOffset);
+		(const BYTE*) (pDescriptor + 1) <= pView + nSize && pDescriptor->Name &&
+		! prefetch.bStop;
+		pDescriptor++) {
+		DWORD dwNameOffset = rvaToOffset( pSections, nSections, pDescriptor->Name, nSize );
+		if (! dwNameOffset) continue;
+		const char* pszName = (const char*) pView + dwNameOffset;
+		size_t nMaxLen = nSize - dwNameOffset;
+		if (nMaxLen > MAX_LONG_PATH - 1) nMaxLen = MAX_LONG_PATH - 1;
+		size_t nLen = 0;
+		while (nLen < nMaxLen && pszName[ nLen ]) nLen++;
+		if (nLen == nMaxLen) continue;
+
+		// Already in memory, or an API set (resolved by the loader)
+		if (! _strnicmp( pszName, "api-ms-", 7 ) || ! _strnicmp( pszName, "ext-ms-", 7 ) ||
+			GetModuleHandleA( pszName ))
+			continue;
+
+		if (! MultiByteToWideChar( CP_ACP, 0, pszName, (int) nLen + 1, pwszName,
+			MAX_LONG_PATH ))
+			continue;
+		// The directory of the image is searched first, like the loader does
+		DWORD nPathLen = SearchPath( pwszDirectory, pwszName, NULL, MAX_LONG_PATH, pwszPath,
+			NULL );
+		if (! nPathLen || nPathLen >= MAX_LONG_PATH)
+			nPathLen = SearchPath( NULL, pwszName, NULL, MAX_LONG_PATH, pwszPath, NULL );
+		if (nPathLen && nPathLen < MAX_LONG_PATH) prefetchFile( pwszPath, NULL );
+	}
+	freeHeap( pwszName );
+	freeHeap( pwszPath );
+}
+
+
+//
+// Prefetch a file. If pwszDirectory is not NULL, the file is the image of
+// the command: the DLLs it imports (searched in pwszDirectory first) are
+// prefetched too.
+//
+static void prefetchFile( const wchar_t* pwszPath, const wchar_t* pwszDirectory )
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency( &frequency );
+	QueryPerformanceCounter( &start );
+
+	HANDLE hFile = CreateFile( pwszPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	LARGE_INTEGER size = { 0 };
+	HANDLE hMapping = NULL;
+	const BYTE* pView = NULL;
+	if (hFile != INVALID_HANDLE_VALUE && GetFileSizeEx( hFile, &size ) && size.QuadPart &&
+		(ULONGLONG) size.QuadPart <= (SIZE_T) -1) {
+		hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+		if (hMapping) pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+	}
+
+	if (pView) {
+		SIZE_T nSize = (SIZE_T) size.QuadPart;
+		prefetchView( pView, nSize );
+		QueryPerformanceCounter( &end );
+		prefetch.nFiles++;
+		prefetch.nBytes += nSize;
+		logDebug( L"Prefetched %ls (%lu KB) in %lu ms", pwszPath, (DWORD) (nSize / 1024),
+			(DWORD) ((end.QuadPart - start.QuadPart) * 1000 / frequency.QuadPart) );
+
+		// The image is left mapped until its imports are prefetched
+		if (pwszDirectory) prefetchImports( pView, nSize, pwszDirectory );
+		UnmapViewOfFile( pView );
+	}
+	else logDebug( L"Could not prefetch %ls (code: 0x%08lX)", pwszPath, GetLastError() );
+
+	if (hMapping) CloseHandle( hMapping );
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle( hFile );
+}
+
+
+static DWORD WINAPI prefetchThread( LPVOID pParameter )
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency( &frequency );
+	QueryPerformanceCounter( &start );
+
+	wchar_t* pwszImagePath = resolveImagePath( prefetch.pwszCommandLine );
+	if (! pwszImagePath) {
+		logDebug( L"Could not prefetch the image (code: 0x%08lX)", GetLastError() );
+		return 0;
+	}
+
+	// Directory of the image, for the search of its DLLs
+	size_t nLen = wcslen( pwszImagePath );
+	wchar_t* pwszDirectory = allocHeap( 0, (nLen + 1) * sizeof( wchar_t ) );
+	memcpy( pwszDirectory, pwszImagePath, (nLen + 1) * sizeof( wchar_t ) );
+	wchar_t* pSeparator = wcsrchr( pwszDirectory, L'\\' );
+	if (pSeparator) *pSeparator = L'\0';
+
+	prefetchFile( pwszImagePath, pwszDirectory );
+
+	QueryPerformanceCounter( &end );
+	logDebug( L"Prefetch %ls: %d files, %lu KB in %lu ms",
+		prefetch.bStop ? L"stopped" : L"done", prefetch.nFiles,
+		(DWORD) (prefetch.nBytes / 1024),
+		(DWORD) ((end.QuadPart - start.QuadPart) * 1000 / frequency.QuadPart) );
+
+	freeHeap( pwszDirectory );
+	freeHeap( pwszImagePath );
+	return 0;
+}
+
+
+void prefetchStart( const wchar_t* pcwszCommandLine )
+{
+	prefetch.pfnPrefetchVirtualMemory = (PREFETCH_VIRTUAL_MEMORY) GetProcAddress(
+		GetModuleHandle( L"kernel32.dll" ), "PrefetchVirtualMemory" );
+
+	size_t nSize = (wcslen( pcwszCommandLine ) + 1) * sizeof( wchar_t );
+	prefetch.pwszCommandLine = allocHeap( 0, nSize );
+	memcpy( prefetch.pwszCommandLine, pcwszCommandLine, nSize );
+
+	prefetch.bStop = FALSE;
+	prefetch.hThread = CreateThread( NULL, 64 * 1024, prefetchThread, NULL,
+		STACK_SIZE_PARAM_IS_A_RESERVATION, NULL );
+	if (! prefetch.hThread) {
+		logDebug( L"Could not start the prefetch (code: 0x%08lX)", GetLastError() );
+		freeHeap( prefetch.pwszCommandLine );
+		prefetch.pwszCommandLine = NULL;
+	}
+}
+
+
+void prefetchStop( void )
+{
+	if (! prefetch.hThread) return;
+
+	// The file being prefetched is finished, the next ones are skipped
+	prefetch.bStop = TRUE;
+	WaitForSingleObject( prefetch.hThread, INFINITE );
+	CloseHandle( prefetch.hThread );
+	prefetch.hThread = NULL;
+	freeHeap( prefetch.pwszCommandLine );
+	prefetch.pwszCommandLine = NULL;
+}
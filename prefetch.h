@@ -0,0 +1,18 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	prefetch.h
+
+	Prefetch of the image of the child process
+
+*/
+
+// Start reading the image of a command line and the DLLs it imports into the
+// file cache, on a background thread.
+void prefetchStart( const wchar_t* pcwszCommandLine );
+
+// Stop the prefetch and wait for the end of the thread (if started).
+void prefetchStop( void );
@@ -0,0 +1,419 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	procops.c
+
+	Built-in process control
+
+	Terminates, suspends or resumes processes matched by PID, image name or
+	image path, instead of running taskkill for each one. The processes are
+	enumerated once per command, with a single snapshot. The processes matched
+	by a verb are opened and controlled in parallel on a thread pool, and their
+	terminations are awaited with thread-pool waits.
+
+*/
+
+#include <windows.h>
+#include <tlhelp32.h>
+#include <stdlib.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"   // Leveled logging
+
+// Default timeout of the waits for a process termination (in milliseconds)
+#define PROCESS_WAIT_TIMEOUT 30000
+
+#define POOL_MAX_THREADS 16
+
+// Exit code of the terminated processes
+#define KILL_EXIT_CODE 1
+
+// Actions
+#define ACTION_KILL 0
+#define ACTION_SUSPEND 1
+#define ACTION_RESUME 2
+
+static const struct {
+	const wchar_t* pcwszName;
+	const wchar_t* pcwszDone;
+	DWORD dwAccess;
+} actions[] = {
+	{ L"terminate", L"Terminated", PROCESS_TERMINATE | SYNCHRONIZE },
+	{ L"suspend", L"Suspended", PROCESS_SUSPEND_RESUME },
+	{ L"resume", L"Resumed", PROCESS_SUSPEND_RESUME }
+};
+
+typedef LONG (NTAPI* NT_PROCESS_FUNCTION)( HANDLE hProcess );
+
+// Process matched by a verb
+typedef struct {
+	const PROCESSENTRY32W* pEntry;  // In the snapshot
+	HANDLE hProcess;
+	PTP_WAIT pWait;       // Wait for the termination
+	DWORD dwError;
+	BOOL bSkipped;        // Its PID was reused, or its image path does not match
+	LARGE_INTEGER start;
+	DWORD dwElapsed;      // In milliseconds
+} TARGET;
+
+static struct {
+	// Snapshot
+	PROCESSENTRY32W* pProcesses;
+	DWORD nProcesses;
+	FILETIME snapshotTime;
+
+	DWORD dwWaitTimeout;
+	NT_PROCESS_FUNCTION pfnSuspend, pfnResume;
+
+	// Thread pool
+	PTP_POOL pPool;
+	PTP_CLEANUP_GROUP pCleanupGroup;
+	TP_CALLBACK_ENVIRON callbackEnviron;
+	HANDLE hToken;  // Impersonation token of the callbacks
+
+	// Current verb
+	int iAction;
+	BOOL bMatchImage;               // The target is an image name or path
+	const wchar_t* pcwszImagePath;  // Full image path to match, or NULL
+	volatile LONG nPending;
+	HANDLE hDone;
+	LARGE_INTEGER frequency;
+} proc = { .dwWaitTimeout = PROCESS_WAIT_TIMEOUT };
+
+
+static int takeSnapshot( void )
+{
+	// Read first: the processes listed by the snapshot were created before
+	GetSystemTimeAsFileTime( &proc.snapshotTime );
+	HANDLE hSnapshot = CreateToolhelp32Snapshot( TH32CS_SNAPPROCESS, 0 );
+	if (hSnapshot == INVALID_HANDLE_VALUE) {
+		printError( L"Failed to enumerate processes", GetLastError(), 0 );
+		return 7;
+	}
+
+	DWORD nCapacity = 256;
+	proc.pProcesses = allocHeap( 0, nCapacity * sizeof( PROCESSENTRY32W ) );
+	proc.nProcesses = 0;
+	PROCESSENTRY32W entry = { .dwSize = sizeof( entry ) };
+	for (BOOL bFound = Process32FirstW( hSnapshot, &entry ); bFound;
+		bFound = Process32NextW( hSnapshot, &entry )) {
+		if (proc.nProcesses == nCapacity) {
+			nCapacity *= 2;
+			PROCESSENTRY32W* pProcesses = allocHeap( 0, nCapacity * sizeof( PROCESSENTRY32W ) );
+			memcpy( pProcesses, proc.pProcesses, proc.nProcesses * sizeof( PROCESSENTRY32W ) );
+			freeHeap( proc.pProcesses );
+			proc.pProcesses = pProcesses;
+		}
+		proc.pProcesses[ proc.nProcesses++ ] = entry;
+	}
+
+	CloseHandle( hSnapshot );
+	return 0;
+}
+
+
+static void completeTarget( TARGET* pTarget )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	pTarget->dwElapsed = (DWORD) ((now.QuadPart - pTarget->start.QuadPart) * 1000 /
+		proc.frequency.QuadPart);
+	if (InterlockedDecrement( &proc.nPending ) == 0) SetEvent( proc.hDone );
+}
+
+
+static VOID CALLBACK terminationWaitCallback( PTP_CALLBACK_INSTANCE pInstance,
+	PVOID pParameter, PTP_WAIT pWait, TP_WAIT_RESULT waitResult )
+{
+	TARGET* pTarget = pParameter;
+	if (waitResult == WAIT_TIMEOUT) pTarget->dwError = WAIT_TIMEOUT;
+	completeTarget( pTarget );
+}
+
+
+//
+// Check that an opened process is the one of the snapshot, and not a later
+// one that reused its PID: it was created before the snapshot and, for an
+// image name or path target, it runs the matched image.
+//
+static BOOL isSnapshotProcess( const TARGET* pTarget )
+{
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (! GetProcessTimes( pTarget->hProcess, &creationTime, &exitTime, &kernelTime,
+		&userTime ) || CompareFileTime( &creationTime, &proc.snapshotTime ) > 0)
+		return FALSE;
+	if (! proc.bMatchImage) return TRUE;
+
+	wchar_t* pwszPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+	DWORD nSize = MAX_LONG_PATH;
+	BOOL bSame = FALSE;
+	if (QueryFullProcessImageName( pTarget->hProcess, 0, pwszPath, &nSize )) {
+		const wchar_t* pwszFileName = wcsrchr( pwszPath, L'\\' );
+		pwszFileName = pwszFileName ? pwszFileName + 1 : pwszPath;
+		bSame = ! _wcsicmp( pwszFileName, pTarget->pEntry->szExeFile ) &&
+			(! proc.pcwszImagePath || ! _wcsicmp( pwszPath, proc.pcwszImagePath ));
+	}
+	freeHeap( pwszPath );
+	return bSame;
+}
+
+
+static VOID CALLBACK controlCallback( PTP_CALLBACK_INSTANCE pInstance, PVOID pParameter )
+{
+	TARGET* pTarget = pParameter;
+	BOOL bWaiting = FALSE;
+
+	SetThreadToken( NULL, proc.hToken );
+	pTarget->hProcess = OpenProcess( PROCESS_QUERY_LIMITED_INFORMATION |
+		actions[ proc.iAction ].dwAccess, FALSE, pTarget->pEntry->th32ProcessID );
+	if (! pTarget->hProcess) pTarget->dwError = GetLastError();
+	else if (! isSnapshotProcess( pTarget )) pTarget->bSkipped = TRUE;
+	else if (proc.iAction == ACTION_KILL) {
+		if (! TerminateProcess( pTarget->hProcess, KILL_EXIT_CODE ))
+			pTarget->dwError = GetLastError();
+		else {
+			// The termination is asynchronous
+			pTarget->pWait = CreateThreadpoolWait( terminationWaitCallback, pTarget,
+				&proc.callbackEnviron );
+			if (pTarget->pWait) {
+				LONGLONG nDueTime = -(LONGLONG) proc.dwWaitTimeout * 10000;
+				FILETIME dueTime = { (DWORD) nDueTime, (DWORD) (nDueTime >> 32) };
+				SetThreadpoolWait( pTarget->pWait, pTarget->hProcess, &dueTime );
+				bWaiting = TRUE;
+			}
+			else pTarget->dwError = GetLastError();
+		}
+	}
+	else {
+		NT_PROCESS_FUNCTION pfnControl = (proc.iAction == ACTION_SUSPEND) ?
+			proc.pfnSuspend : proc.pfnResume;
+		LONG status = pfnControl( pTarget->hProcess );
+		if (status < 0) pTarget->dwError = (DWORD) status;  // NTSTATUS
+	}
+	SetThreadToken( NULL, NULL );
+
+	if (! bWaiting) completeTarget( pTarget );
+}
+
+
+static BOOL isProcessId( const wchar_t* pwszTarget, DWORD* pdwProcessId )
+{
+	wchar_t* pEnd;
+	unsigned long nProcessId = wcstoul( pwszTarget, &pEnd, 10 );
+	if (pEnd == pwszTarget || *pEnd) return FALSE;
+	*pdwProcessId = nProcessId;
+	return TRUE;
+}
+
+
+//
+// Check whether the image name of a process matches a name (".exe" can be
+// omitted).
+//
+static BOOL isSameName( const wchar_t* pwszExeFile, const wchar_t* pwszName )
+{
+	if (! _wcsicmp( pwszExeFile, pwszName )) return TRUE;
+	size_t nLen = wcslen( pwszName );
+	return ! _wcsnicmp( pwszExeFile, pwszName, nLen ) &&
+		! _wcsicmp( pwszExeFile + nLen, L".exe" );
+}
+
+
+//
+// Apply an action to the processes matched by a target: a PID, an image name
+// or an image path (the name of the image is checked first, with the snapshot,
+// then again with its path when the process is opened). The processes
+// created after the snapshot are skipped.
+//
+static int runAction( int iAction, const wchar_t* pwszTarget )
+{
+	if (! proc.pProcesses) {
+		int errCode = takeSnapshot();
+		if (errCode) return errCode;
+	}
+
+	if (iAction != ACTION_KILL && ! proc.pfnSuspend) {
+		printError( L"Process suspension is not supported", 0, 0 );
+		return 7;
+	}
+
+	DWORD dwProcessId = 0;
+	BOOL bProcessId = isProcessId( pwszTarget, &dwProcessId );
+	wchar_t* pwszImagePath = NULL;
+	const wchar_t* pwszName = pwszTarget;
+	if (! bProcessId && (wcschr( pwszTarget, L'\\' ) || wcschr( pwszTarget, L'/' ))) {
+		wchar_t* pwszFilePart = NULL;
+		pwszImagePath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+		DWORD nLen = GetFullPathName( pwszTarget, MAX_LONG_PATH, pwszImagePath,
+			&pwszFilePart );
+		if (! nLen || nLen >= MAX_LONG_PATH || ! pwszFilePart) {
+			printError( L"Invalid path", GetLastError(), 0 );
+			freeHeap( pwszImagePath );
+			return 1;
+		}
+		pwszName = pwszFilePart;
+	}
+
+	// Matching processes, except this one
+	TARGET* pTargets = allocHeap( HEAP_ZERO_MEMORY, proc.nProcesses * sizeof( TARGET ) );
+	LONG nTargets = 0;
+	DWORD dwCurrentProcessId = GetCurrentProcessId();
+	for (DWORD i = 0; i < proc.nProcesses; i++) {
+		const PROCESSENTRY32W* pEntry = &proc.pProcesses[ i ];
+		if (pEntry->th32ProcessID == dwCurrentProcessId || ! pEntry->th32ProcessID) continue;
+		if (bProcessId ? pEntry->th32ProcessID == dwProcessId :
+			isSameName( pEntry->szExeFile, pwszName ))
+			pTargets[ nTargets++ ].pEntry = pEntry;
+	}
+
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter( &start );
+
+	// Open and control all the targets in parallel
+	proc.iAction = iAction;
+	proc.bMatchImage = ! bProcessId;
+	proc.pcwszImagePath = pwszImagePath;
+	proc.nPending = nTargets;
+	if (nTargets) {
+		for (LONG i = 0; i < nTargets; i++) {
+			TARGET* pTarget = &pTargets[ i ];
+			pTarget->start = start;
+			if (! TrySubmitThreadpoolCallback( controlCallback, pTarget,
+				&proc.callbackEnviron )) {
+				pTarget->dwError = GetLastError();
+				completeTarget( pTarget );
+			}
+		}
+		WaitForSingleObject( proc.hDone, INFINITE );
+		// Release the waits
+		CloseThreadpoolCleanupGroupMembers( proc.pCleanupGroup, FALSE, NULL );
+	}
+	QueryPerformanceCounter( &end );
+
+	int nDone = 0, nFailed = 0, nSkipped = 0;
+	for (LONG i = 0; i < nTargets; i++) {
+		TARGET* pTarget = &pTargets[ i ];
+		if (pTarget->hProcess) CloseHandle( pTarget->hProcess );
+		if (pTarget->bSkipped) {
+			logDebug( L"Skipped process %lu (%ls): not the enumerated process or image",
+				pTarget->pEntry->th32ProcessID, pTarget->pEntry->szExeFile );
+			nSkipped++;
+			continue;
+		}
+		if (pTarget->dwError) {
+			logError( L"Failed to %ls process %lu (%ls) (code: 0x%08lX)",
+				actions[ iAction ].pcwszName, pTarget->pEntry->th32ProcessID,
+				pTarget->pEntry->szExeFile, pTarget->dwError );
+			nFailed++;
+		}
+		else {
+			printFmtConsole( L"%ls process %lu (%ls) in %lu ms\n", actions[ iAction ].pcwszDone,
+				pTarget->pEntry->th32ProcessID, pTarget->pEntry->szExeFile,
+				pTarget->dwElapsed );
+			nDone++;
+		}
+	}
+
+	freeHeap( pTargets );
+	if (pwszImagePath) freeHeap( pwszImagePath );
+
+	if (! nDone && ! nFailed) {
+		if (nSkipped)
+			logError( L"No process found: %ls (%d skipped, /v for details)",
+				pwszTarget, nSkipped );
+		else logError( L"No process found: %ls", pwszTarget );
+		return 7;
+	}
+
+	printFmtConsole( L"%d processes, %d failed, in %.1f ms\n", nDone + nFailed, nFailed,
+		(double) (end.QuadPart - start.QuadPart) * 1000 / proc.frequency.QuadPart );
+	return nFailed ? 7 : 0;
+}
+
+
+static int killVerb( wchar_t** argv )
+{
+	return runAction( ACTION_KILL, argv[ 0 ] );
+}
+
+
+static int suspendVerb( wchar_t** argv )
+{
+	return runAction( ACTION_SUSPEND, argv[ 0 ] );
+}
+
+
+static int resumeVerb( wchar_t** argv )
+{
+	return runAction( ACTION_RESUME, argv[ 0 ] );
+}
+
+
+static int checkTimeoutVerb( wchar_t** argv )
+{
+	DWORD dwSeconds;
+	return parseNumberArgument( argv[ 0 ], L"timeout in seconds", 1, 86400, &dwSeconds );
+}
+
+
+static int timeoutVerb( wchar_t** argv )
+{
+	DWORD dwSeconds;
+	int errCode = parseNumberArgument( argv[ 0 ], L"timeout in seconds", 1, 86400,
+		&dwSeconds );
+	if (! errCode) proc.dwWaitTimeout = dwSeconds * 1000;
+	return errCode;
+}
+
+
+static const VERB procVerbs[] = {
+	{ L"kill", 1, killVerb },
+	{ L"suspend", 1, suspendVerb },
+	{ L"resume", 1, resumeVerb },
+	{ L"timeout", 1, timeoutVerb, checkTimeoutVerb }
+};
+
+
+int runProcCommand( int argc, wchar_t** argv )
+{
+	// Not documented, but available since Windows XP
+	HMODULE hNtdll = GetModuleHandle( L"ntdll.dll" );
+	proc.pfnSuspend = (NT_PROCESS_FUNCTION) GetProcAddress( hNtdll, "NtSuspendProcess" );
+	proc.pfnResume = (NT_PROCESS_FUNCTION) GetProcAddress( hNtdll, "NtResumeProcess" );
+	if (! proc.pfnResume) proc.pfnSuspend = NULL;
+
+	QueryPerformanceFrequency( &proc.frequency );
+	OpenThreadToken( GetCurrentThread(), TOKEN_IMPERSONATE | TOKEN_QUERY, TRUE,
+		&proc.hToken );
+	proc.hDone = CreateEvent( NULL, FALSE, FALSE, NULL );
+
+	int errCode = 0;
+	InitializeThreadpoolEnvironment( &proc.callbackEnviron );
+	proc.pPool = CreateThreadpool( NULL );
+	if (proc.pPool) {
+		SetThreadpoolThreadMaximum( proc.pPool, POOL_MAX_THREADS );
+		SetThreadpoolCallbackPool( &proc.callbackEnviron, proc.pPool );
+		proc.pCleanupGroup = CreateThreadpoolCleanupGroup();
+	}
+	if (! proc.hDone || ! proc.pCleanupGroup) {
+		printError( L"Failed to create thread pool", GetLastError(), 0 );
+		errCode = 5;
+	}
+	else {
+		SetThreadpoolCallbackCleanupGroup( &proc.callbackEnviron, proc.pCleanupGroup, NULL );
+		errCode = runVerbs( procVerbs, sizeof( procVerbs ) / sizeof( *procVerbs ), argc, argv );
+	}
+
+	if (proc.pCleanupGroup) {
+		CloseThreadpoolCleanupGroupMembers( proc.pCleanupGroup, TRUE, NULL );
+		CloseThreadpoolCleanupGroup( proc.pCleanupGroup );
+	}
+	if (proc.pPool) CloseThreadpool( proc.pPool );
+	DestroyThreadpoolEnvironment( &proc.callbackEnviron );
+	if (proc.hDone) CloseHandle( proc.hDone );
+	if (proc.hToken) CloseHandle( proc.hToken );
+	if (proc.pProcesses) freeHeap( proc.pProcesses );
+	return errCode;
+}
@@ -0,0 +1,13 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	procops.h
+
+	Built-in process control
+
+*/
+
+int runProcCommand( int argc, wchar_t** argv );
@@ -0,0 +1,752 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	regops.c
+
+	Built-in registry operations
+
+	They are performed by superUser itself on a thread impersonating the
+	TrustedInstaller token, instead of creating reg.exe for each one.
+	The last opened key stays open, so that consecutive operations on the
+	same key (e.g. all the values of an imported section) share it.
+
+*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "utils.h" // Utility functions
+
+// Access to the keys. The 64-bit view is used even by superUser32 on a
+// 64-bit system.
+#define KEY_ACCESS (KEY_READ | KEY_WRITE | DELETE | KEY_WOW64_64KEY)
+
+static const struct {
+	const wchar_t* pcwszName;
+	const wchar_t* pcwszShortName;
+	HKEY hKey;
+} rootKeys[] = {
+	{ L"HKEY_LOCAL_MACHINE", L"HKLM", HKEY_LOCAL_MACHINE },
+	{ L"HKEY_CURRENT_USER", L"HKCU", HKEY_CURRENT_USER },
+	{ L"HKEY_CLASSES_ROOT", L"HKCR", HKEY_CLASSES_ROOT },
+	{ L"HKEY_USERS", L"HKU", HKEY_USERS },
+	{ L"HKEY_CURRENT_CONFIG", L"HKCC", HKEY_CURRENT_CONFIG }
+};
+
+// Last opened key, shared by consecutive operations
+static struct {
+	wchar_t* pwszPath;
+	HKEY hKey;
+} cachedKey;
+
+
+static int regError( const wchar_t* pwszMessage, LSTATUS status )
+{
+	printError( pwszMessage, (DWORD) status, 0 );
+	return 7;
+}
+
+
+//
+// Split a key path into its root key (long or short name) and its subkey.
+// Return the index of the root key in rootKeys, or -1 if it is invalid.
+//
+static int splitKeyPath( const wchar_t* pwszPath, const wchar_t** ppwszSubKey )
+{
+	const wchar_t* pSep = wcschr( pwszPath, L'\\' );
+	size_t nRootLen = pSep ? (size_t) (pSep - pwszPath) : wcslen( pwszPath );
+
+	for (int i = 0; i < sizeof( rootKeys ) / sizeof( *rootKeys ); i++) {
+		if ((wcslen( rootKeys[ i ].pcwszName ) == nRootLen &&
+			! _wcsnicmp( pwszPath, rootKeys[ i ].pcwszName, nRootLen )) ||
+			(wcslen( rootKeys[ i ].pcwszShortName ) == nRootLen &&
+				! _wcsnicmp( pwszPath, rootKeys[ i ].pcwszShortName, nRootLen ))) {
+			*ppwszSubKey = pSep ? pSep + 1 : L"";
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+static void closeCachedKey( void )
+{
+	if (cachedKey.pwszPath) {
+		RegCloseKey( cachedKey.hKey );
+		freeHeap( cachedKey.pwszPath );
+		cachedKey.pwszPath = NULL;
+	}
+}
+
+
+//
+// Open (or create) a key, reusing the last opened key if it is the same.
+//
+static LSTATUS openKey( const wchar_t* pwszPath, BOOL bCreate, HKEY* phKey )
+{
+	if (cachedKey.pwszPath && ! _wcsicmp( pwszPath, cachedKey.pwszPath )) {
+		*phKey = cachedKey.hKey;
+		return ERROR_SUCCESS;
+	}
+
+	const wchar_t* pwszSubKey;
+	int iRoot = splitKeyPath( pwszPath, &pwszSubKey );
+	if (iRoot < 0) return ERROR_BAD_PATHNAME;
+
+	HKEY hKey = NULL;
+	LSTATUS status;
+	if (bCreate)
+		status = RegCreateKeyEx( rootKeys[ iRoot ].hKey, pwszSubKey, 0, NULL, 0,
+			KEY_ACCESS, NULL, &hKey, NULL );
+	else
+		status = RegOpenKeyEx( rootKeys[ iRoot ].hKey, pwszSubKey, 0, KEY_ACCESS, &hKey );
+	if (status != ERROR_SUCCESS) return status;
+
+	closeCachedKey();
+	size_t nPathSize = (wcslen( pwszPath ) + 1) * sizeof( wchar_t );
+	cachedKey.pwszPath = allocHeap( 0, nPathSize );
+	memcpy( cachedKey.pwszPath, pwszPath, nPathSize );
+	cachedKey.hKey = hKey;
+
+	*phKey = hKey;
+	return ERROR_SUCCESS;
+}
+
+
+//
+// Delete a key and all its subkeys.
+//
+static LSTATUS deleteKey( const wchar_t* pwszPath )
+{
+	// The cached key may be the deleted key or one of its subkeys
+	closeCachedKey();
+
+	const wchar_t* pwszSubKey;
+	int iRoot = splitKeyPath( pwszPath, &pwszSubKey );
+	if (iRoot < 0) return ERROR_BAD_PATHNAME;
+	if (! *pwszSubKey) return ERROR_ACCESS_DENIED;  // Root keys cannot be deleted
+
+	// Open the parent key, then delete the last component of the path
+	const wchar_t* pwszName = wcsrchr( pwszSubKey, L'\\' );
+	size_t nParentLen = pwszName ? (size_t) (pwszName - pwszSubKey) : 0;
+	pwszName = pwszName ? pwszName + 1 : pwszSubKey;
+
+	wchar_t* pwszParent = allocHeap( HEAP_ZERO_MEMORY,
+		(nParentLen + 1) * sizeof( wchar_t ) );
+	memcpy( pwszParent, pwszSubKey, nParentLen * sizeof( wchar_t ) );
+
+	HKEY hParent = NULL;
+	LSTATUS status = RegOpenKeyEx( rootKeys[ iRoot ].hKey, pwszParent, 0, KEY_ACCESS,
+		&hParent );
+	if (status == ERROR_SUCCESS) {
+		status = RegDeleteTree( hParent, pwszName );
+		RegCloseKey( hParent );
+	}
+
+	freeHeap( pwszParent );
+	return status;
+}
+
+
+static int hexDigit( wchar_t c )
+{
+	if (c >= L'0' && c <= L'9') return c - L'0';
+	if (c >= L'a' && c <= L'f') return c - L'a' + 10;
+	if (c >= L'A' && c <= L'F') return c - L'A' + 10;
+	return -1;
+}
+
+
+//
+// Parse hexadecimal bytes, optionally separated by commas (e.g. "01,ab,ff").
+// Return the number of bytes, or -1 if the string is invalid.
+//
+static int parseHexBytes( const wchar_t* pwszHex, BYTE* pData )
+{
+	int nBytes = 0;
+	const wchar_t* p = pwszHex;
+	while (*p) {
+		if (*p == L',' || *p == L' ' || *p == L'\t') {
+			p++;
+			continue;
+		}
+		int hi = hexDigit( p[ 0 ] ), lo = hi < 0 ? -1 : hexDigit( p[ 1 ] );
+		if (lo < 0) return -1;
+		pData[ nBytes++ ] = (BYTE) (hi << 4 | lo);
+		p += 2;
+	}
+	return nBytes;
+}
+
+
+//
+// Convert the data argument of the "set" verb according to the value type.
+// pData must hold at least (wcslen( pwszData ) + 4) * sizeof( wchar_t ) bytes.
+//
+static BOOL parseValueData( const wchar_t* pwszType, const wchar_t* pwszData,
+	DWORD* pdwType, BYTE* pData, DWORD* pcbData )
+{
+	wchar_t* pEnd = NULL;
+	size_t nLen = wcslen( pwszData );
+	errno = 0;
+
+	if (! _wcsicmp( pwszType, L"REG_SZ" ) || ! _wcsicmp( pwszType, L"REG_EXPAND_SZ" )) {
+		*pdwType = _wcsicmp( pwszType, L"REG_SZ" ) ? REG_EXPAND_SZ : REG_SZ;
+		*pcbData = (DWORD) ((nLen + 1) * sizeof( wchar_t ));
+		memcpy( pData, pwszData, *pcbData );
+	}
+	else if (! _wcsicmp( pwszType, L"REG_MULTI_SZ" )) {
+		// Strings are separated by "\0", like with reg.exe
+		*pdwType = REG_MULTI_SZ;
+		wchar_t* pDest = (wchar_t*) pData;
+		for (const wchar_t* p = pwszData; *p; p++) {
+			if (p[ 0 ] == L'\\' && p[ 1 ] == L'0') {
+				*pDest++ = L'\0';
+				p++;
+			}
+			else *pDest++ = *p;
+		}
+		*pDest++ = L'\0';
+		*pDest++ = L'\0';
+		*pcbData = (DWORD) ((BYTE*) pDest - pData);
+	}
+	else if (! _wcsicmp( pwszType, L"REG_DWORD" )) {
+		*pdwType = REG_DWORD;
+		*(DWORD*) pData = wcstoul( pwszData, &pEnd, 0 );
+		*pcbData = sizeof( DWORD );
+	}
+	else if (! _wcsicmp( pwszType, L"REG_QWORD" )) {
+		*pdwType = REG_QWORD;
+		*(ULONGLONG*) pData = _wcstoui64( pwszData, &pEnd, 0 );
+		*pcbData = sizeof( ULONGLONG );
+	}
+	else if (! _wcsicmp( pwszType, L"REG_BINARY" ) || ! _wcsicmp( pwszType, L"REG_NONE" )) {
+		*pdwType = _wcsicmp( pwszType, L"REG_NONE" ) ? REG_BINARY : REG_NONE;
+		int nBytes = parseHexBytes( pwszData, pData );
+		if (nBytes < 0) return FALSE;
+		*pcbData = (DWORD) nBytes;
+	}
+	else return FALSE;
+
+	// Numbers must be fully parsed, and fit in the value (no saturation)
+	return ! pEnd || (pEnd != pwszData && ! *pEnd && errno != ERANGE);
+}
+
+
+//
+// Value name argument: "@" stands for the default value.
+//
+static const wchar_t* valueName( const wchar_t* pwszName )
+{
+	return wcscmp( pwszName, L"@" ) ? pwszName : L"";
+}
+
+
+//
+// Convert the type and data arguments of the "set" verb.
+// Return a buffer allocated from the process heap, or NULL (logged) if they
+// are invalid.
+//
+static BYTE* parseSetArguments( wchar_t** argv, DWORD* pdwType, DWORD* pcbData )
+{
+	BYTE* pData = allocHeap( 0, (wcslen( argv[ 3 ] ) + 4) * sizeof( wchar_t ) );
+	if (! parseValueData( argv[ 2 ], argv[ 3 ], pdwType, pData, pcbData )) {
+		printError( L"Invalid value type or data", 0, 0 );
+		freeHeap( pData );
+		return NULL;
+	}
+	return pData;
+}
+
+
+static int checkSetVerb( wchar_t** argv )
+{
+	DWORD dwType, cbData;
+	BYTE* pData = parseSetArguments( argv, &dwType, &cbData );
+	if (! pData) return 1;
+	freeHeap( pData );
+	return 0;
+}
+
+
+static int setVerb( wchar_t** argv )
+{
+	DWORD dwType, cbData;
+	BYTE* pData = parseSetArguments( argv, &dwType, &cbData );
+	if (! pData) return 1;
+
+	int errCode = 0;
+	HKEY hKey;
+	LSTATUS status = openKey( argv[ 0 ], TRUE, &hKey );
+	if (status == ERROR_SUCCESS)
+		status = RegSetValueEx( hKey, valueName( argv[ 1 ] ), 0, dwType, pData, cbData );
+	if (status != ERROR_SUCCESS) errCode = regError( L"Failed to set value", status );
+
+	freeHeap( pData );
+	return errCode;
+}
+
+
+static int delvalVerb( wchar_t** argv )
+{
+	HKEY hKey;
+	LSTATUS status = openKey( argv[ 0 ], FALSE, &hKey );
+	if (status == ERROR_SUCCESS) status = RegDeleteValue( hKey, valueName( argv[ 1 ] ) );
+	if (status != ERROR_SUCCESS) return regError( L"Failed to delete value", status );
+	return 0;
+}
+
+
+static int delkeyVerb( wchar_t** argv )
+{
+	LSTATUS status = deleteKey( argv[ 0 ] );
+	if (status != ERROR_SUCCESS) return regError( L"Failed to delete key", status );
+	return 0;
+}
+
+
+//
+// Export
+//
+
+// Buffered UTF-16LE output to a .reg file
+typedef struct {
+	HANDLE hFile;
+	DWORD nUsed;
+	LSTATUS status;
+	wchar_t buffer[ 32768 ];
+} REG_WRITER;
+
+
+static void flushWriter( REG_WRITER* pWriter )
+{
+	DWORD dwWritten;
+	if (pWriter->nUsed && pWriter->status == ERROR_SUCCESS &&
+		! WriteFile( pWriter->hFile, pWriter->buffer, pWriter->nUsed * sizeof( wchar_t ),
+			&dwWritten, NULL ))
+		pWriter->status = GetLastError();
+	pWriter->nUsed = 0;
+}
+
+
+static void writeChars( REG_WRITER* pWriter, const wchar_t* pwsz, size_t nLen )
+{
+	while (nLen) {
+		if (pWriter->nUsed == sizeof( pWriter->buffer ) / sizeof( wchar_t ))
+			flushWriter( pWriter );
+		DWORD nChunk = sizeof( pWriter->buffer ) / sizeof( wchar_t ) - pWriter->nUsed;
+		if (nChunk > nLen) nChunk = (DWORD) nLen;
+		memcpy( pWriter->buffer + pWriter->nUsed, pwsz, nChunk * sizeof( wchar_t ) );
+		pWriter->nUsed += nChunk;
+		pwsz += nChunk;
+		nLen -= nChunk;
+	}
+}
+
+
+static void writeString( REG_WRITER* pWriter, const wchar_t* pwsz )
+{
+	writeChars( pWriter, pwsz, wcslen( pwsz ) );
+}
+
+
+// Write a quoted string, escaping backslashes and quotes
+static void writeQuoted( REG_WRITER* pWriter, const wchar_t* pwsz, size_t nLen )
+{
+	writeChars( pWriter, L"\"", 1 );
+	for (size_t i = 0; i < nLen; i++) {
+		if (pwsz[ i ] == L'\\' || pwsz[ i ] == L'"') writeChars( pWriter, L"\\", 1 );
+		writeChars( pWriter, pwsz + i, 1 );
+	}
+	writeChars( pWriter, L"\"", 1 );
+}
+
+
+static void writeHex( REG_WRITER* pWriter, const BYTE* pData, DWORD cbData )
+{
+	static const wchar_t hex[] = L"0123456789abcdef";
+	for (DWORD i = 0; i < cbData; i++) {
+		wchar_t digits[ 3 ] = { hex[ pData[ i ] >> 4 ], hex[ pData[ i ] & 15 ], L',' };
+		writeChars( pWriter, digits, (i + 1 < cbData) ? 3 : 2 );
+	}
+}
+
+
+static void writeValue( REG_WRITER* pWriter, const wchar_t* pwszName, DWORD dwType,
+	const BYTE* pData, DWORD cbData )
+{
+	if (*pwszName) writeQuoted( pWriter, pwszName, wcslen( pwszName ) );
+	else writeChars( pWriter, L"@", 1 );
+	writeChars( pWriter, L"=", 1 );
+
+	// Strings are written as text only if they are well-formed
+	size_t nLen = cbData / sizeof( wchar_t );
+	const wchar_t* pwszData = (const wchar_t*) pData;
+	if (dwType == REG_SZ && cbData % sizeof( wchar_t ) == 0 && nLen > 0 &&
+		pwszData[ nLen - 1 ] == L'\0' && wcslen( pwszData ) == nLen - 1) {
+		writeQuoted( pWriter, pwszData, nLen - 1 );
+	}
+	else if (dwType == REG_DWORD && cbData == sizeof( DWORD )) {
+		static const wchar_t hex[] = L"0123456789abcdef";
+		wchar_t wszDword[ 14 ] = L"dword:";
+		DWORD dwValue = *(const DWORD*) pData;
+		for (int i = 0; i < 8; i++) wszDword[ 6 + i ] = hex[ (dwValue >> (28 - i * 4)) & 15 ];
+		writeChars( pWriter, wszDword, 14 );
+	}
+	else {
+		if (dwType == REG_BINARY) writeString( pWriter, L"hex:" );
+		else {
+			wchar_t wszType[ 16 ];
+			_snwprintf( wszType, 16, L"hex(%lx):", dwType );
+			wszType[ 15 ] = L'\0';
+			writeString( pWriter, wszType );
+		}
+		writeHex( pWriter, pData, cbData );
+	}
+	writeChars( pWriter, L"\r\n", 2 );
+}
+
+
+//
+// Export a key and its subkeys. pwszPath is the full path, with the long
+// name of the root key.
+//
+static LSTATUS exportKey( REG_WRITER* pWriter, HKEY hKey, const wchar_t* pwszPath )
+{
+	writeChars( pWriter, L"\r\n[", 3 );
+	writeString( pWriter, pwszPath );
+	writeChars( pWriter, L"]\r\n", 3 );
+
+	DWORD nValues, nMaxNameLen, cbMaxData, nSubKeys;
+	LSTATUS status = RegQueryInfoKey( hKey, NULL, NULL, NULL, &nSubKeys, NULL, NULL,
+		&nValues, &nMaxNameLen, &cbMaxData, NULL, NULL );
+	if (status != ERROR_SUCCESS) return status;
+
+	if (nValues) {
+		wchar_t* pwszName = allocHeap( 0, (nMaxNameLen + 1) * sizeof( wchar_t ) );
+		BYTE* pData = allocHeap( 0, cbMaxData + 1 );
+		for (DWORD i = 0; i < nValues && status == ERROR_SUCCESS; i++) {
+			DWORD nNameLen = nMaxNameLen + 1, cbData = cbMaxData, dwType;
+			status = RegEnumValue( hKey, i, pwszName, &nNameLen, NULL, &dwType, pData,
+				&cbData );
+			if (status == ERROR_SUCCESS) writeValue( pWriter, pwszName, dwType, pData, cbData );
+		}
+		freeHeap( pData );
+		freeHeap( pwszName );
+	}
+
+	size_t nPathLen = wcslen( pwszPath );
+	for (DWORD i = 0; i < nSubKeys && status == ERROR_SUCCESS; i++) {
+		wchar_t wszName[ 256 ];  // Maximum key name length + 1
+		DWORD nNameLen = 256;
+		status = RegEnumKeyEx( hKey, i, wszName, &nNameLen, NULL, NULL, NULL, NULL );
+		if (status != ERROR_SUCCESS) break;
+
+		wchar_t* pwszSubPath = allocHeap( 0, (nPathLen + nNameLen + 2) * sizeof( wchar_t ) );
+		memcpy( pwszSubPath, pwszPath, nPathLen * sizeof( wchar_t ) );
+		pwszSubPath[ nPathLen ] = L'\\';
+		memcpy( pwszSubPath + nPathLen + 1, wszName, (nNameLen + 1) * sizeof( wchar_t ) );
+
+		HKEY hSubKey;
+		status = RegOpenKeyEx( hKey, wszName, 0, KEY_READ | KEY_WOW64_64KEY, &hSubKey );
+		if (status == ERROR_SUCCESS) {
+			status = exportKey( pWriter, hSubKey, pwszSubPath );
+			RegCloseKey( hSubKey );
+		}
+		freeHeap( pwszSubPath );
+	}
+
+	return status;
+}
+
+
+static int exportVerb( wchar_t** argv )
+{
+	const wchar_t* pwszSubKey;
+	int iRoot = splitKeyPath( argv[ 0 ], &pwszSubKey );
+	if (iRoot < 0) return regError( L"Failed to export key", ERROR_BAD_PATHNAME );
+
+	HKEY hKey;
+	LSTATUS status = RegOpenKeyEx( rootKeys[ iRoot ].hKey, pwszSubKey, 0,
+		KEY_READ | KEY_WOW64_64KEY, &hKey );
+	if (status != ERROR_SUCCESS) return regError( L"Failed to export key", status );
+
+	REG_WRITER* pWriter = allocHeap( 0, sizeof( REG_WRITER ) );
+	pWriter->nUsed = 0;
+	pWriter->status = ERROR_SUCCESS;
+	pWriter->hFile = CreateFile( argv[ 1 ], GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (pWriter->hFile != INVALID_HANDLE_VALUE) {
+		// Build the full path with the long name of the root key
+		size_t nRootLen = wcslen( rootKeys[ iRoot ].pcwszName );
+		size_t nSubKeyLen = wcslen( pwszSubKey );
+		wchar_t* pwszPath = allocHeap( HEAP_ZERO_MEMORY,
+			(nRootLen + nSubKeyLen + 2) * sizeof( wchar_t ) );
+		memcpy( pwszPath, rootKeys[ iRoot ].pcwszName, nRootLen * sizeof( wchar_t ) );
+		if (nSubKeyLen) {
+			pwszPath[ nRootLen ] = L'\\';
+			memcpy( pwszPath + nRootLen + 1, pwszSubKey, nSubKeyLen * sizeof( wchar_t ) );
+		}
+
+		writeString( pWriter, L"\xFEFFWindows Registry Editor Version 5.00\r\n" );
+		status = exportKey( pWriter, hKey, pwszPath );
+		writeChars( pWriter, L"\r\n", 2 );
+		flushWriter( pWriter );
+		if (status == ERROR_SUCCESS) status = pWriter->status;
+
+		freeHeap( pwszPath );
+		CloseHandle( pWriter->hFile );
+	}
+	else status = GetLastError();
+
+	freeHeap( pWriter );
+	RegCloseKey( hKey );
+
+	if (status != ERROR_SUCCESS) return regError( L"Failed to export key", status );
+	return 0;
+}
+
+
+//
+// Import
+//
+
+//
+// Read a whole .reg file and convert it to a null-terminated wide string.
+// Unicode (version 5) files are UTF-16LE; REGEDIT4 files are ANSI.
+//
+static wchar_t* readRegFile( const wchar_t* pwszFileName, BOOL* pbAnsi )
+{
+	HANDLE hFile = CreateFile( pwszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (hFile == INVALID_HANDLE_VALUE) return NULL;
+
+	wchar_t* pwszText = NULL;
+	LARGE_INTEGER size;
+	DWORD dwRead;
+	if (GetFileSizeEx( hFile, &size ) && size.QuadPart < 0x40000000) {
+		BYTE* pBuffer = allocHeap( 0, size.LowPart + sizeof( wchar_t ) );
+		if (ReadFile( hFile, pBuffer, size.LowPart, &dwRead, NULL ) &&
+			dwRead == size.LowPart) {
+			if (dwRead >= 2 && pBuffer[ 0 ] == 0xFF && pBuffer[ 1 ] == 0xFE) {
+				// UTF-16LE: skip the BOM
+				pwszText = allocHeap( 0, dwRead + sizeof( wchar_t ) );
+				memcpy( pwszText, pBuffer + 2, dwRead - 2 );
+				pwszText[ (dwRead - 2) / sizeof( wchar_t ) ] = L'\0';
+				*pbAnsi = FALSE;
+			}
+			else {
+				pwszText = allocHeap( 0, (dwRead + 1) * sizeof( wchar_t ) );
+				int nLen = MultiByteToWideChar( CP_ACP, 0, (char*) pBuffer, dwRead,
+					pwszText, dwRead );
+				pwszText[ nLen > 0 ? nLen : 0 ] = L'\0';
+				*pbAnsi = TRUE;
+			}
+		}
+		freeHeap( pBuffer );
+	}
+	else SetLastError( ERROR_FILE_TOO_LARGE );
+
+	DWORD dwLastError = GetLastError();
+	CloseHandle( hFile );
+	SetLastError( dwLastError );
+	return pwszText;
+}
+
+
+//
+// Unescape a quoted string starting after its opening quote. The result is
+// written to pOut, which may be the input itself. Return a pointer after the
+// closing quote, or NULL if there is none.
+//
+static wchar_t* unescapeString( wchar_t* p, wchar_t* pOut, size_t* pnLen )
+{
+	wchar_t* pBegin = pOut;
+	while (*p && *p != L'"') {
+		if (*p == L'\\' && p[ 1 ]) p++;
+		*pOut++ = *p++;
+	}
+	if (*p != L'"') return NULL;
+	*pOut = L'\0';
+	*pnLen = pOut - pBegin;
+	return p + 1;
+}
+
+
+static wchar_t* skipSpaces( wchar_t* p )
+{
+	while (*p == L' ' || *p == L'\t') p++;
+	return p;
+}
+
+
+//
+// Import a value line ("name"=data or @=data) into the key.
+// pData must be large enough to hold the data of the line.
+//
+static LSTATUS importValue( HKEY hKey, wchar_t* pwszLine, BOOL bAnsi, BYTE* pData )
+{
+	// Value name
+	wchar_t* pwszName = pwszLine;
+	wchar_t* p;
+	size_t nLen;
+	if (*pwszLine == L'@') {
+		p = pwszLine + 1;
+		*pwszName = L'\0';
+	}
+	else if (! (p = unescapeString( pwszLine + 1, pwszName, &nLen )))
+		return ERROR_INVALID_DATA;
+
+	p = skipSpaces( p );
+	if (*p++ != L'=') return ERROR_INVALID_DATA;
+	p = skipSpaces( p );
+
+	// Value data
+	DWORD dwType, cbData;
+	if (! wcscmp( p, L"-" )) {
+		LSTATUS status = RegDeleteValue( hKey, pwszName );
+		return (status == ERROR_FILE_NOT_FOUND) ? ERROR_SUCCESS : status;
+	}
+
+	if (*p == L'"') {
+		wchar_t* pwszData = (wchar_t*) pData;
+		if (! unescapeString( p + 1, pwszData, &nLen )) return ERROR_INVALID_DATA;
+		dwType = REG_SZ;
+		cbData = (DWORD) ((nLen + 1) * sizeof( wchar_t ));
+	}
+	else if (! _wcsnicmp( p, L"dword:", 6 )) {
+		wchar_t* pEnd;
+		errno = 0;
+		*(DWORD*) pData = wcstoul( p + 6, &pEnd, 16 );
+		if (pEnd == p + 6 || *skipSpaces( pEnd ) || errno == ERANGE)
+			return ERROR_INVALID_DATA;
+		dwType = REG_DWORD;
+		cbData = sizeof( DWORD );
+	}
+	else if (! _wcsnicmp( p, L"hex", 3 )) {
+		p += 3;
+		dwType = REG_BINARY;
+		if (*p == L'(') {
+			dwType = wcstoul( p + 1, &p, 16 );
+			if (*p++ != L')') return ERROR_INVALID_DATA;
+		}
+		if (*p++ != L':') return ERROR_INVALID_DATA;
+
+		int nBytes = parseHexBytes( p, pData );
+		if (nBytes < 0) return ERROR_INVALID_DATA;
+		cbData = (DWORD) nBytes;
+
+		// In REGEDIT4 files, the strings stored in hexadecimal form are ANSI
+		if (bAnsi && cbData &&
+			(dwType == REG_SZ || dwType == REG_EXPAND_SZ || dwType == REG_MULTI_SZ)) {
+			wchar_t* pwszData = allocHeap( 0, cbData * sizeof( wchar_t ) );
+			int nChars = MultiByteToWideChar( CP_ACP, 0, (char*) pData, cbData, pwszData,
+				cbData );
+			cbData = (DWORD) (nChars > 0 ? nChars : 0) * sizeof( wchar_t );
+			memcpy( pData, pwszData, cbData );
+			freeHeap( pwszData );
+		}
+	}
+	else return ERROR_INVALID_DATA;
+
+	return RegSetValueEx( hKey, pwszName, 0, dwType, pData, cbData );
+}
+
+
+static int importVerb( wchar_t** argv )
+{
+	BOOL bAnsi = FALSE;
+	wchar_t* pwszText = readRegFile( argv[ 0 ], &bAnsi );
+	if (! pwszText) return regError( L"Failed to read .reg file", GetLastError() );
+
+	// A logical line is never longer than the whole text. The data of a line
+	// takes at most two bytes per character.
+	size_t nTextLen = wcslen( pwszText );
+	wchar_t* pwszLine = allocHeap( 0, (nTextLen + 1) * sizeof( wchar_t ) );
+	BYTE* pData = allocHeap( 0, (nTextLen + 2) * sizeof( wchar_t ) );
+
+	LSTATUS status = ERROR_SUCCESS;
+	HKEY hKey = NULL;  // Key of the current section
+	int nLine = 0, nLogicalLine = 0;
+	BOOL bHeader = TRUE;
+	wchar_t* p = pwszText;
+
+	while (*p && status == ERROR_SUCCESS) {
+		// Build a logical line: lines ending with a backslash continue
+		// on the next one (long hexadecimal data)
+		size_t nLen = 0;
+		nLogicalLine = nLine + 1;
+		for (;;) {
+			nLine++;
+			wchar_t* pBegin = skipSpaces( p );
+			while (*p && *p != L'\n') p++;
+			wchar_t* pEnd = p;
+			if (*p) p++;
+			while (pEnd > pBegin && (pEnd[ -1 ] == L'\r' || pEnd[ -1 ] == L' ' ||
+				pEnd[ -1 ] == L'\t'))
+				pEnd--;
+			memcpy( pwszLine + nLen, pBegin, (pEnd - pBegin) * sizeof( wchar_t ) );
+			nLen += pEnd - pBegin;
+			if (nLen && pwszLine[ nLen - 1 ] == L'\\' && *p) nLen--;
+			else break;
+		}
+		pwszLine[ nLen ] = L'\0';
+
+		if (! nLen || *pwszLine == L';') continue;
+
+		if (bHeader) {
+			// First non-empty line
+			if (wcscmp( pwszLine, L"Windows Registry Editor Version 5.00" ) &&
+				wcscmp( pwszLine, L"REGEDIT4" ))
+				status = ERROR_INVALID_DATA;
+			bHeader = FALSE;
+		}
+		else if (*pwszLine == L'[' && pwszLine[ nLen - 1 ] == L']') {
+			// Section: [key] or [-key] to delete it
+			pwszLine[ nLen - 1 ] = L'\0';
+			hKey = NULL;
+			if (pwszLine[ 1 ] == L'-') {
+				status = deleteKey( pwszLine + 2 );
+				if (status == ERROR_FILE_NOT_FOUND) status = ERROR_SUCCESS;
+			}
+			else status = openKey( pwszLine + 1, TRUE, &hKey );
+		}
+		else if (*pwszLine == L'"' || *pwszLine == L'@') {
+			// Values of a deleted key are ignored
+			if (hKey) status = importValue( hKey, pwszLine, bAnsi, pData );
+		}
+		else status = ERROR_INVALID_DATA;
+	}
+
+	freeHeap( pData );
+	freeHeap( pwszLine );
+	freeHeap( pwszText );
+
+	if (status != ERROR_SUCCESS) {
+		printError( L"Failed to import .reg file line", status, nLogicalLine );
+		return 7;
+	}
+	return 0;
+}
+
+
+static const VERB regVerbs[] = {
+	{ L"set", 4, setVerb, checkSetVerb },
+	{ L"delval", 2, delvalVerb },
+	{ L"delkey", 1, delkeyVerb },
+	{ L"export", 2, exportVerb },
+	{ L"import", 1, importVerb }
+};
+
+
+int runRegCommand( int argc, wchar_t** argv )
+{
+	int errCode = runVerbs( regVerbs, sizeof( regVerbs ) / sizeof( *regVerbs ),
+		argc, argv );
+	closeCachedKey();
+	return errCode;
+}
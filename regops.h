@@ -0,0 +1,13 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	regops.h
+
+	Built-in registry operations
+
+*/
+
+int runRegCommand( int argc, wchar_t** argv );
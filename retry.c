@@ -0,0 +1,155 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	retry.c
+
+	Retry of the operations failing with transient errors
+
+	Under heavy load, the service control manager, a TrustedInstaller service
+	being restarted or a lack of resources can make an operation fail once and
+	succeed a moment later. Each phase has a policy: the errors considered as
+	transient, the maximum number of attempts, and a jittered exponential
+	backoff bounded by a total deadline. Nothing is added to an operation that
+	succeeds at the first attempt. Each retry is logged at the debug level, and
+	the totals at the info level (only if there were retries).
+
+*/
+
+#include <windows.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"   // Leveled logging
+#include "retry.h"
+
+// See tokens.c
+#define CUSTOM_ERROR_SERVICE_START_FAILED 0xA0001001
+
+typedef struct {
+	const wchar_t* pcwszName;
+	int nMaxAttempts;
+	DWORD dwBaseDelay;   // Delay before the first retry (ms)
+	DWORD dwMaxDelay;    // Maximum delay between two attempts (ms)
+	DWORD dwDeadline;    // Maximum total time of the attempts (ms)
+	const DWORD* pdwTransientErrors;
+	int nTransientErrors;
+} RETRY_POLICY;
+
+// ERROR_ACCESS_DENIED and ERROR_INVALID_PARAMETER are normally permanent:
+// they are transient only when the TrustedInstaller process has exited
+// (RETRY_STATE.hProcess, or CUSTOM_ERROR_SERVICE_START_FAILED for the service).
+
+static const DWORD adwServiceErrors[] = {
+	ERROR_SERVICE_ALREADY_RUNNING,
+	ERROR_SERVICE_CANNOT_ACCEPT_CTRL,  // Service being stopped
+	ERROR_SERVICE_DATABASE_LOCKED,
+	ERROR_SERVICE_REQUEST_TIMEOUT,
+	RPC_S_SERVER_UNAVAILABLE,
+	RPC_S_SERVER_TOO_BUSY,
+	CUSTOM_ERROR_SERVICE_START_FAILED  // Service stopped again, or being stopped
+};
+
+static const DWORD adwTokenErrors[] = {
+	ERROR_NOT_ENOUGH_MEMORY,
+	ERROR_NO_SYSTEM_RESOURCES,
+	RPC_S_SERVER_UNAVAILABLE,
+	RPC_S_SERVER_TOO_BUSY
+};
+
+static const DWORD adwCreateErrors[] = {
+	ERROR_NOT_ENOUGH_MEMORY,
+	ERROR_PARTIAL_COPY,
+	ERROR_NO_SYSTEM_RESOURCES,
+	ERROR_COMMITMENT_LIMIT,
+	ERROR_NOT_ENOUGH_QUOTA
+};
+
+#define ERRORS( a ) a, sizeof( a ) / sizeof( *a )
+
+static const RETRY_POLICY retryPolicies[ RETRY_PHASES ] = {
+	{ L"service", 6, 50, 1000, 10000, ERRORS( adwServiceErrors ) },
+	{ L"token", 4, 20, 250, 2000, ERRORS( adwTokenErrors ) },
+	{ L"create", 5, 50, 1000, 5000, ERRORS( adwCreateErrors ) }
+};
+
+// Statistics, by phase
+static volatile LONG anRetries[ RETRY_PHASES ];
+static volatile LONG anWaitTimes[ RETRY_PHASES ];
+
+
+void retryBegin( RETRY_STATE* pState, RETRY_PHASE phase )
+{
+	pState->phase = phase;
+	pState->nAttempts = 0;
+	pState->dwStart = GetTickCount();
+	pState->hProcess = NULL;
+	pState->dwSeed = pState->dwStart ^ GetCurrentThreadId() ^
+		(DWORD) (ULONG_PTR) pState;
+	if (! pState->dwSeed) pState->dwSeed = 1;
+}
+
+
+DWORD retryDelay( RETRY_STATE* pState, DWORD dwError )
+{
+	const RETRY_POLICY* pPolicy = &retryPolicies[ pState->phase ];
+
+	BOOL bTransient = FALSE;
+	if (dwError == ERROR_ACCESS_DENIED || dwError == ERROR_INVALID_PARAMETER)
+		// Process being terminated or already terminated
+		bTransient = pState->hProcess &&
+			WaitForSingleObject( pState->hProcess, 0 ) == WAIT_OBJECT_0;
+	else {
+		for (int i = 0; i < pPolicy->nTransientErrors; i++)
+			if (pPolicy->pdwTransientErrors[ i ] == dwError) {
+				bTransient = TRUE;
+				break;
+			}
+	}
+	if (! bTransient || ++pState->nAttempts >= pPolicy->nMaxAttempts) return INFINITE;
+
+	DWORD dwElapsed = GetTickCount() - pState->dwStart;
+	if (dwElapsed >= pPolicy->dwDeadline) return INFINITE;
+
+	// Exponential backoff with jitter: a random delay between the half and
+	// the whole of the backoff, so that concurrent instances spread out
+	DWORD dwBackoff = pPolicy->dwBaseDelay << (pState->nAttempts - 1);
+	if (pState->nAttempts > 16 || dwBackoff > pPolicy->dwMaxDelay)
+		dwBackoff = pPolicy->dwMaxDelay;
+
+	// xorshift32
+	DWORD x = pState->dwSeed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	pState->dwSeed = x;
+
+	DWORD dwDelay = dwBackoff / 2 + x % (dwBackoff / 2 + 1);
+	if (dwDelay > pPolicy->dwDeadline - dwElapsed) dwDelay = pPolicy->dwDeadline - dwElapsed;
+
+	InterlockedIncrement( &anRetries[ pState->phase ] );
+	InterlockedExchangeAdd( &anWaitTimes[ pState->phase ], (LONG) dwDelay );
+
+	logDebug( L"Transient error 0x%08lX (%ls), retrying in %lu ms", dwError,
+		pPolicy->pcwszName, dwDelay );
+
+	return dwDelay;
+}
+
+
+BOOL retryWait( RETRY_STATE* pState, DWORD dwError )
+{
+	DWORD dwDelay = retryDelay( pState, dwError );
+	if (dwDelay == INFINITE) return FALSE;
+	Sleep( dwDelay );
+	return TRUE;
+}
+
+
+void logRetryStats( void )
+{
+	for (int i = 0; i < RETRY_PHASES; i++)
+		if (anRetries[ i ])
+			logInfo( L"Retries (%ls): %ld, %ld ms", retryPolicies[ i ].pcwszName,
+				anRetries[ i ], anWaitTimes[ i ] );
+}
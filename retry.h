@@ -0,0 +1,45 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	retry.h
+
+	Retry of the operations failing with transient errors
+
+*/
+
+// Phases, each with its own retry policy
+typedef enum {
+	RETRY_SERVICE,  // SCM, TrustedInstaller service and process
+	RETRY_TOKEN,    // Process tokens
+	RETRY_CREATE,   // Child process creation
+	RETRY_PHASES
+} RETRY_PHASE;
+
+// State of the retries of an operation
+typedef struct {
+	RETRY_PHASE phase;
+	int nAttempts;   // Failed attempts
+	DWORD dwStart;   // Start time (tick count)
+	DWORD dwSeed;    // State of the jitter generator
+	HANDLE hProcess; // TrustedInstaller process used by the operation, or NULL.
+	                 // ERROR_ACCESS_DENIED and ERROR_INVALID_PARAMETER are only
+	                 // transient once it has exited.
+} RETRY_STATE;
+
+// Start the retries of an operation.
+void retryBegin( RETRY_STATE* pState, RETRY_PHASE phase );
+
+// Return the delay (ms) before the next attempt of a failed operation,
+// or INFINITE if the error is not transient or the policy is exhausted.
+DWORD retryDelay( RETRY_STATE* pState, DWORD dwError );
+
+// Wait before the next attempt of a failed operation, blocking the calling
+// thread (the launch engine schedules its attempts with timers instead).
+// Return FALSE if the operation must not be retried.
+BOOL retryWait( RETRY_STATE* pState, DWORD dwError );
+
+// Log the number of retries and the time spent waiting, by phase.
+void logRetryStats( void );
@@ -11,20 +11,38 @@
 */
 
 #include <windows.h>
+#include <stdio.h>
 
 #include "utils.h"  // Utility functions
 #include "tokens.h" // Tokens and privileges management functions
+#include "fileops.h" // Built-in file operations
+#include "regops.h" // Built-in registry operations
+#include "svcops.h" // Built-in service control
+#include "aclreset.h" // Built-in recursive ownership and ACL reset
+#include "tarops.h" // Built-in backup archiver
+#include "procops.h" // Built-in process control
+#include "launch.h" // Non-blocking launch engine
+#include "allowlist.h" // Allowlist of the commands run as TrustedInstaller
+#include "retry.h" // Retry of the operations failing with transient errors
+#include "log.h"   // Leveled logging
+#include "prefetch.h" // Prefetch of the image of the child process
 
 // Program options
 static struct {
 	unsigned int bMinimize : 1;    // Whether to minimize created window
 	unsigned int bSeamless : 1;    // Whether child process shares parent's console
-	unsigned int bVerbose : 1;     // Whether to print debug messages or not
 	unsigned int bWait : 1;        // Whether to wait for child process to finish
-} options = {0};
-
-#define printFmtVerbose(...) \
-	if (options.bVerbose) printFmtConsole(__VA_ARGS__);
+	unsigned int bRemovePrivileges : 1; // Whether to remove privileges outside the profile
+	unsigned int bPrefetch : 1;    // Whether to prefetch the image of the command
+	ULONGLONG privileges;          // Privileges enabled in the child process token
+	wchar_t* pwszPolicyFile;       // Allowlist policy file
+	wchar_t* pwszLogFile;          // Log file
+	wchar_t* pwszCurrentDirectory; // Current directory of the child process (full path)
+	wchar_t** ppwszVariables;      // Environment changes ("NAME=VALUE" or "NAME=")
+	int nVariables;
+	wchar_t* pwszEnvironment;      // Environment block of the child process
+	int iLogLevel;                 // Log level (raised by /v)
+} options = { .privileges = PRIVILEGES_ALL, .iLogLevel = LOG_INFO };
 
 /*
 	Return codes (without /w option):
@@ -33,6 +51,8 @@ static struct {
 		3 - Failed to open/start TrustedInstaller process/service
 		4 - Process creation failed
 		5 - Another fatal error occurred
+		7 - A built-in command failed
+		8 - The command is not allowed by the policy
 
 	If the /w option is specified, the exit code of the child process is returned.
 	If superUser fails, it returns the code -(EXIT_CODE_BASE + errCode),
@@ -55,131 +75,258 @@ static int getExitCode( int code )
 }
 
 
-static int createChildProcess( wchar_t* pwszImageName )
-{
-	int errCode = 0;
-	HANDLE hBaseProcess = NULL, hChildProcessToken = NULL;
-
-	// Start the TrustedInstaller service and get its process handle
-	errCode = getTrustedInstallerProcess( &hBaseProcess );
-	if (errCode) return errCode;
-
-	if (options.bSeamless) {
-		// Create the child process token
-		errCode = createChildProcessToken( hBaseProcess, &hChildProcessToken );
-		if (errCode) {
-			CloseHandle( hBaseProcess );
-			return errCode;
-		}
+static HANDLE hLaunchCreated = NULL, hLaunchCompleted = NULL;
+static HANDLE hChildProcess = NULL;  // Child process waited for by this thread (/w)
+static DWORD dwChildProcessError = 0;
 
-		// Get the console session id and set it in the token
-		DWORD dwSessionId = WTSGetActiveConsoleSessionId();
-		if (dwSessionId != (DWORD) -1) {
-			SetTokenInformation( hChildProcessToken, TokenSessionId, (PVOID) &dwSessionId,
-				sizeof( DWORD ) );
-		}
 
-		// Set all privileges in the child process token
-		setAllPrivileges( hChildProcessToken, options.bVerbose );
+static void launchCallback( int iEvent, const LAUNCH_RESULT* pResult, void* pContext )
+{
+	if (iEvent == LAUNCH_EVENT_CREATED && options.bWait) {
+		// The process handle is only valid during the callback
+		if (! DuplicateHandle( GetCurrentProcess(), pResult->hProcess, GetCurrentProcess(),
+			&hChildProcess, SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, 0 )) {
+			dwChildProcessError = GetLastError();
+			hChildProcess = NULL;
+		}
+	}
+	if (iEvent == LAUNCH_EVENT_COMPLETED) {
+		*(int*) pContext = pResult->errCode;
+		SetEvent( hLaunchCompleted );
 	}
+	// Also set on completion, the creation may have failed
+	SetEvent( hLaunchCreated );
+}
 
-	// Initialize startupInfo
 
-	STARTUPINFOEX startupInfo = {0};
+//
+// Shed everything that the wait for the child process does not need (the
+// launch engine, with its threads and cached handles, is already shut down):
+// the free heap blocks and the working set. The CRT output buffers and the log
+// file are flushed first (stdout is buffered when redirected), so that no
+// pending write brings the pages back before the child exits.
+//
+static void releaseFootprint( void )
+{
+	fflush( stdout );
+	fflush( stderr );
+	logFlush();
+	HeapCompact( GetProcessHeap(), 0 );
+	SetProcessWorkingSetSize( GetCurrentProcess(), (SIZE_T) -1, (SIZE_T) -1 );
+}
 
-	startupInfo.StartupInfo.cb = sizeof( STARTUPINFOEX );
-	startupInfo.StartupInfo.dwFlags = STARTF_USESHOWWINDOW;
-	if (options.bMinimize)
-		startupInfo.StartupInfo.wShowWindow = SW_SHOWMINNOACTIVE;
-	else
-		startupInfo.StartupInfo.wShowWindow = SW_SHOWNORMAL;
 
-	if (! options.bSeamless) {
-		// Initialize attribute lists for "parent assignment"
+//
+// Command line running a checked batch file with the command interpreter of
+// the system (not %ComSpec%, which the caller controls):
+//   cmd.exe /d /s /c ""<image path>" <arguments>"
+// /d skips the AutoRun commands, /s removes the outer quotes as they are.
+// Return a buffer allocated from the process heap, and the path of cmd.exe in
+// *ppwszInterpreter (also allocated from the process heap).
+//
+static wchar_t* buildScriptCommandLine( const wchar_t* pcwszImagePath,
+	const wchar_t* pcwszCommandLine, wchar_t** ppwszInterpreter )
+{
+	// Arguments: what follows the first token of the command line
+	const wchar_t* p = pcwszCommandLine;
+	while (*p == L' ' || *p == L'\t') p++;
+	if (*p == L'"') {
+		p++;
+		while (*p && *p != L'"') p++;
+		if (*p) p++;
+	}
+	else while (*p && *p != L' ' && *p != L'\t') p++;
+	const wchar_t* pcwszArguments = p;
+
+	UINT nDirLen = GetSystemDirectory( NULL, 0 );
+	*ppwszInterpreter = allocHeap( 0, (nDirLen + 8) * sizeof( wchar_t ) );
+	nDirLen = GetSystemDirectory( *ppwszInterpreter, nDirLen );
+	memcpy( *ppwszInterpreter + nDirLen, L"\\cmd.exe", 9 * sizeof( wchar_t ) );
+
+	static const wchar_t wszFormat[] = L"\"%ls\" /d /s /c \"\"%ls\"%ls\"";
+	size_t nSize = wcslen( *ppwszInterpreter ) + wcslen( pcwszImagePath ) +
+		wcslen( pcwszArguments ) + sizeof( wszFormat ) / sizeof( wchar_t );
+	wchar_t* pwszCommandLine = allocHeap( 0, nSize * sizeof( wchar_t ) );
+	_snwprintf( pwszCommandLine, nSize, wszFormat, *ppwszInterpreter, pcwszImagePath,
+		pcwszArguments );
+	pwszCommandLine[ nSize - 1 ] = L'\0';
+	return pwszCommandLine;
+}
 
-		SIZE_T attributeListLength = 0;
-		InitializeProcThreadAttributeList( NULL, 1, 0, (PSIZE_T) &attributeListLength );
-		startupInfo.lpAttributeList = allocHeap( HEAP_ZERO_MEMORY, attributeListLength );
-		InitializeProcThreadAttributeList( startupInfo.lpAttributeList, 1, 0,
-			(PSIZE_T) &attributeListLength );
 
-		UpdateProcThreadAttribute( startupInfo.lpAttributeList, 0,
-			PROC_THREAD_ATTRIBUTE_PARENT_PROCESS, &hBaseProcess, sizeof( HANDLE ), NULL, NULL );
+static int createChildProcess( wchar_t* pwszCommandLine )
+{
+	// Check the command against the allowlist. The image cannot be modified
+	// until the child process is created.
+	wchar_t* pwszImagePath = NULL;
+	HANDLE hImage = NULL;
+	if (options.pwszPolicyFile) {
+		int errCode = checkAllowlist( options.pwszPolicyFile, pwszCommandLine,
+			&pwszImagePath, &hImage );
+		if (errCode) return errCode;
 	}
 
-	// Create process
-
-	PROCESS_INFORMATION processInfo = {0};
-	DWORD dwCreationFlags = 0;
-	if (! options.bSeamless)
-		dwCreationFlags = CREATE_SUSPENDED | EXTENDED_STARTUPINFO_PRESENT |
-		CREATE_NEW_CONSOLE;
-
-	printFmtVerbose( L"[D] Creating specified process\n" );
-
-	BOOL bCreateResult = CreateProcessAsUser(
-		hChildProcessToken,
-		NULL,
-		pwszImageName,
-		NULL,
-		NULL,
-		FALSE,
-		dwCreationFlags,
-		NULL,
-		NULL,
-		(LPSTARTUPINFO) &startupInfo,
-		&processInfo
-	);
-
-	DWORD dwCreateError = bCreateResult ? 0 : GetLastError();
-
-	if (options.bSeamless) CloseHandle( hChildProcessToken );
-	else {
-		DeleteProcThreadAttributeList( startupInfo.lpAttributeList );
-		freeHeap( startupInfo.lpAttributeList );
+	// The checked image is run, not the one that the command line would designate.
+	// Batch files are run by the command interpreter, which reads them while
+	// they run: they stay locked until the end.
+	const wchar_t* pcwszApplicationName = pwszImagePath;
+	wchar_t* pwszInterpreter = NULL;
+	wchar_t* pwszScriptCommandLine = NULL;
+	if (pwszImagePath) {
+		const wchar_t* pcwszExtension = wcsrchr( pwszImagePath, L'.' );
+		if (pcwszExtension && (! _wcsicmp( pcwszExtension, L".bat" ) ||
+			! _wcsicmp( pcwszExtension, L".cmd" ))) {
+			pwszScriptCommandLine = buildScriptCommandLine( pwszImagePath, pwszCommandLine,
+				&pwszInterpreter );
+			pcwszApplicationName = pwszInterpreter;
+			logDebug( L"Script command line is '%ls'", pwszScriptCommandLine );
+		}
 	}
-	CloseHandle( hBaseProcess );
-
-	if (bCreateResult) {
-		if (! options.bSeamless) {
-			HANDLE hProcessToken = NULL;
-			OpenProcessToken( processInfo.hProcess, TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
-				&hProcessToken );
-			// Set all privileges in the child process token
-			setAllPrivileges( hProcessToken, options.bVerbose );
-			CloseHandle( hProcessToken );
-
-			ResumeThread( processInfo.hThread );
+
+	LAUNCH_PARAMS params = {
+		.pcwszCommandLine = pwszScriptCommandLine ? pwszScriptCommandLine : pwszCommandLine,
+		.pcwszApplicationName = pcwszApplicationName,
+		.pcwszEnvironment = options.pwszEnvironment,
+		.pcwszCurrentDirectory = options.pwszCurrentDirectory,
+		.dwTimeout = INFINITE,
+		.bMinimize = options.bMinimize,
+		.bSeamless = options.bSeamless,
+		// With /w, the child is waited for by this thread, once the engine and
+		// its threads are gone
+		.bWait = FALSE,
+		.privileges = options.privileges,
+		.bRemovePrivileges = options.bRemovePrivileges
+	};
+
+	// A single launch: this thread only waits for its completion
+	int errCode = launchInitialize( 1 );
+	if (! errCode) {
+		int launchErrCode = 0;
+		hLaunchCreated = CreateEvent( NULL, TRUE, FALSE, NULL );
+		hLaunchCompleted = CreateEvent( NULL, TRUE, FALSE, NULL );
+		errCode = launchStart( &params, launchCallback, &launchErrCode );
+		if (! errCode) {
+			WaitForSingleObject( hLaunchCreated, INFINITE );
+			prefetchStop();
+			if (hImage && ! pwszScriptCommandLine) {
+				CloseHandle( hImage );
+				hImage = NULL;
+			}
+			WaitForSingleObject( hLaunchCompleted, INFINITE );
+			errCode = launchErrCode;
 		}
 
-		printFmtVerbose( L"[D] Created process ID: %lu\n", processInfo.dwProcessId );
+		launchShutdown();
+		CloseHandle( hLaunchCreated );
+		CloseHandle( hLaunchCompleted );
+	}
 
-		if (options.bWait) {
-			printFmtVerbose( L"[D] Waiting for process to exit\n" );
-			WaitForSingleObject( processInfo.hProcess, INFINITE );
+	if (! errCode && options.bWait) {
+		if (hChildProcess) {
+			releaseFootprint();
 
-			// Get exit code of child process
+			logDebug( L"Waiting for process to exit" );
 			DWORD dwExitCode;
-			if (! GetExitCodeProcess( processInfo.hProcess, &dwExitCode ))
-				dwExitCode = getExitCode( 6 );
-
-			printFmtVerbose( L"[D] Process exited with code %ld\n", dwExitCode );
-			nChildExitCode = dwExitCode;
+			WaitForSingleObject( hChildProcess, INFINITE );
+			if (GetExitCodeProcess( hChildProcess, &dwExitCode )) {
+				logDebug( L"Process exited with code %ld", dwExitCode );
+				nChildExitCode = (int) dwExitCode;
+			}
+			else errCode = 6;
+			CloseHandle( hChildProcess );
+			hChildProcess = NULL;
 		}
+		else {
+			printError( L"Failed to wait for process", dwChildProcessError, 0 );
+			errCode = 6;
+		}
+	}
 
-		CloseHandle( processInfo.hProcess );
-		CloseHandle( processInfo.hThread );
+	if (hImage) CloseHandle( hImage );
+	if (pwszImagePath) freeHeap( pwszImagePath );
+	if (pwszInterpreter) freeHeap( pwszInterpreter );
+	if (pwszScriptCommandLine) freeHeap( pwszScriptCommandLine );
+
+	return errCode;
+}
+
+
+static int startLogging( void )
+{
+	logInitialize( options.iLogLevel );
+	if (options.pwszLogFile && logOpenFile( options.pwszLogFile )) return 1;
+	return 0;
+}
+
+
+static void stopLogging( void )
+{
+	logRetryStats();
+	logShutdown();
+	if (options.pwszLogFile) freeHeap( options.pwszLogFile );
+}
+
+
+//
+// Set the current directory of the child process (a full path to an
+// existing directory).
+//
+static int setCurrentDirectory( const wchar_t* pcwszDirectory )
+{
+	DWORD nSize = GetFullPathName( pcwszDirectory, 0, NULL, NULL );
+	wchar_t* pwszFullPath = nSize ? allocHeap( 0, nSize * sizeof( wchar_t ) ) : NULL;
+	DWORD nLen = pwszFullPath ? GetFullPathName( pcwszDirectory, nSize, pwszFullPath, NULL ) : 0;
+	DWORD dwAttributes = (nLen && nLen < nSize) ?
+		GetFileAttributes( pwszFullPath ) : INVALID_FILE_ATTRIBUTES;
+	if (dwAttributes == INVALID_FILE_ATTRIBUTES ||
+		! (dwAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		printError( L"Invalid working directory",
+			(dwAttributes == INVALID_FILE_ATTRIBUTES) ? GetLastError() : ERROR_DIRECTORY, 0 );
+		if (pwszFullPath) freeHeap( pwszFullPath );
+		return 1;
 	}
-	else {
-		// Most commonly - 0x2 - The system cannot find the file specified.
-		printError( L"Process creation failed", dwCreateError, 0 );
-		return 4;
+
+	if (options.pwszCurrentDirectory) freeHeap( options.pwszCurrentDirectory );
+	options.pwszCurrentDirectory = pwszFullPath;
+	return 0;
+}
+
+
+//
+// Add a change to the environment of the child process ("NAME=VALUE", or
+// "NAME=" to remove the variable). The string is kept until the end.
+//
+static int addVariable( wchar_t* pwszVariable )
+{
+	if (*pwszVariable == L'=' || ! wcschr( pwszVariable, L'=' )) {
+		printError( L"Invalid environment variable (NAME=VALUE expected)", 0, 0 );
+		return 1;
 	}
 
+	// The list grows by powers of two
+	int n = options.nVariables;
+	if (! (n & (n - 1))) {
+		wchar_t** ppwszVariables = allocHeap( 0, (n ? 2 * n : 1) * sizeof( wchar_t* ) );
+		if (n) {
+			memcpy( ppwszVariables, options.ppwszVariables, n * sizeof( wchar_t* ) );
+			freeHeap( options.ppwszVariables );
+		}
+		options.ppwszVariables = ppwszVariables;
+	}
+	options.ppwszVariables[ options.nVariables++ ] = pwszVariable;
 	return 0;
 }
 
 
+static void freeEnvironmentOptions( void )
+{
+	for (int i = 0; i < options.nVariables; i++) freeHeap( options.ppwszVariables[ i ] );
+	if (options.ppwszVariables) freeHeap( options.ppwszVariables );
+	if (options.pwszEnvironment) freeHeap( options.pwszEnvironment );
+	if (options.pwszCurrentDirectory) freeHeap( options.pwszCurrentDirectory );
+}
+
+
 static BOOL getArgument( wchar_t** ppArgument, wchar_t** ppArgumentIndex )
 {
 	// Current pointer to the remainder of the line to be parsed.
@@ -210,12 +357,19 @@ static BOOL getArgument( wchar_t** ppArgument, wchar_t** ppArgumentIndex )
 		// Argument found
 		wchar_t* pBegin = p;
 
-		// Search the end of the argument
-		while (*p && *p != L' ' && *p != L'\t') p++;
+		// Search the end of the argument (quoted spaces are part of it)
+		BOOL bQuote = FALSE;
+		while (*p && (bQuote || (*p != L' ' && *p != L'\t'))) {
+			if (*p == L'"') bQuote = ! bQuote;
+			p++;
+		}
 
+		// Copy the argument without its quotes
 		size_t nArgSize = (p - pBegin) * sizeof( wchar_t );
 		*ppArgument = allocHeap( HEAP_ZERO_MEMORY, nArgSize + sizeof( wchar_t ) );
-		memcpy( *ppArgument, pBegin, nArgSize );
+		wchar_t* pDest = *ppArgument;
+		for (wchar_t* pSrc = pBegin; pSrc < p; pSrc++)
+			if (*pSrc != L'"') *pDest++ = *pSrc;
 		*ppArgumentIndex = pBegin;
 		return TRUE;
 	}
@@ -225,16 +379,93 @@ static BOOL getArgument( wchar_t** ppArgument, wchar_t** ppArgumentIndex )
 }
 
 
+// Built-in commands, run in-process while impersonating TrustedInstaller.
+// Their name starts with a colon, which cannot begin a file name.
+static const struct {
+	const wchar_t* pcwszName;
+	int (*pfnRun)( int argc, wchar_t** argv );
+} builtinCommands[] = {
+	{ L":file", runFileCommand },
+	{ L":reg", runRegCommand },
+	{ L":svc", runServiceCommand },
+	{ L":acl", runAclCommand },
+	{ L":tar", runTarCommand },
+	{ L":proc", runProcCommand }
+};
+
+
+static int runBuiltinCommand( int iCommand )
+{
+	// Collect the remaining arguments. Each one takes at least two characters
+	// of the command line (including the separator).
+	int argc = 0;
+	wchar_t** argv = allocHeap( HEAP_ZERO_MEMORY,
+		(wcslen( GetCommandLine() ) / 2 + 1) * sizeof( wchar_t* ) );
+	wchar_t* pwszArgument = NULL;
+	wchar_t* pwszArgumentIndex = NULL;
+	while (getArgument( &pwszArgument, &pwszArgumentIndex )) {
+		argv[ argc++ ] = pwszArgument;
+		pwszArgument = NULL;
+	}
+
+	// An archive written to standard output must not be mixed with the
+	// messages: redirect them before the first one
+	if (builtinCommands[ iCommand ].pfnRun == runTarCommand &&
+		tarWritesStandardOutput( argc, argv )) logToStandardError();
+
+	int errCode = startLogging();
+	if (! errCode) errCode = acquireSeDebugPrivilege();
+	if (! errCode) errCode = createTrustedInstallerContext();
+	if (! errCode) errCode = builtinCommands[ iCommand ].pfnRun( argc, argv );
+	stopLogging();
+
+	for (int i = 0; i < argc; i++) freeHeap( argv[ i ] );
+	freeHeap( argv );
+
+	return errCode;
+}
+
+
 static void printHelp( void )
 {
 	printConsole( L"\n\
 superUser [options] [command_to_run]\n\n\
 Options (you can use either \"-\" or \"/\"):\n\
+  /a  Run the command only if its image is allowed by a policy file,\n\
+      followed by the file name (list of SHA-256 hashes of the images).\n\
+  /d  Current directory of the child process, followed by the directory.\n\
+  /e  Set an environment variable of the child process, followed by\n\
+      NAME=VALUE (NAME= removes the variable). Can be repeated.\n\
+  /f  Prefetch the image of the command and its DLLs while TrustedInstaller\n\
+      is started (faster launch on a cold system).\n\
   /h  Display this help message.\n\
+  /l  Also write the messages to a log file, followed by the file name.\n\
   /m  Minimize the created window.\n\
+  /p  Privileges enabled in the child process token, followed by a profile\n\
+      (all, backup-restore, debug, minimal) or a comma-separated list of\n\
+      privilege names (e.g. SeBackupPrivilege,Restore). Default: all.\n\
+  /r  Remove the privileges outside the /p profile from the child token.\n\
   /s  The child process shares the parent's console. Requires /w.\n\
-  /v  Display verbose messages.\n\
-  /w  Wait for the child process to finish before exiting.\n\
+  /v  Display verbose messages (debug level). /vv also traces the system calls\n\
+      (requires a build with LOG_MAX_LEVEL=3).\n\
+  /w  Wait for the child process to finish before exiting.\n\n\
+Built-in commands (run by superUser itself as TrustedInstaller):\n\
+  :file <verb> <args> [<verb> <args>...]\n\
+        copy <src> <dst>, move <src> <dst>, rename <path> <new_name>,\n\
+        delete <path>, takeown <path>, owner <path> <sid>, dacl <path> <sddl>\n\
+  :reg <verb> <args> [<verb> <args>...]\n\
+        set <key> <name> <type> <data>, delval <key> <name>, delkey <key>,\n\
+        export <key> <file>, import <file>\n\
+  :svc <verb> <args> [<verb> <args>...]\n\
+        query <name>, start <name>, stop <name>, starttype <name> <type>,\n\
+        binpath <name> <path>, timeout <seconds>\n\
+  :acl <verb> <args> [<verb> <args>...]\n\
+        owner <sid>, dacl <sddl>, reset, threads <n>, apply <path>\n\
+  :tar <verb> <args> [<verb> <args>...]\n\
+        out <file|->, threads <n>, add <path>\n\
+  :proc <verb> <args> [<verb> <args>...]\n\
+        kill <target>, suspend <target>, resume <target>, timeout <seconds>\n\
+        (target: process ID, image name or image path)\n\
 " );
 }
 
@@ -260,18 +491,82 @@ int wmain( int argc, wchar_t* argv[] )
 			while ((opt = pwszArgument[ j ])) {
 				// Multiple options can be grouped together (eg: /ws)
 				switch (opt) {
+				case 'd':
+					// The directory is the next argument
+					if (pwszArgument[ j + 1 ] ||
+						! getArgument( &pwszArgument, &pwszArgumentIndex )) {
+						printError( L"Missing working directory", 0, 0 );
+						errCode = 1;
+						goto done_params;
+					}
+					errCode = setCurrentDirectory( pwszArgument );
+					if (errCode) goto done_params;
+					goto next_argument;
+				case 'e':
+					// The variable is the next argument
+					if (pwszArgument[ j + 1 ] ||
+						! getArgument( &pwszArgument, &pwszArgumentIndex )) {
+						printError( L"Missing environment variable", 0, 0 );
+						errCode = 1;
+						goto done_params;
+					}
+					errCode = addVariable( pwszArgument );
+					if (errCode) goto done_params;
+					pwszArgument = NULL;  // Kept until the end
+					goto next_argument;
+				case 'f':
+					options.bPrefetch = 1;
+					break;
 				case 'h':
 					printHelp();
 					errCode = -1;
 					goto done_params;
+				case 'a':
+					// The policy file is the next argument
+					if (pwszArgument[ j + 1 ] ||
+						! getArgument( &pwszArgument, &pwszArgumentIndex )) {
+						printError( L"Missing policy file", 0, 0 );
+						errCode = 1;
+						goto done_params;
+					}
+					if (options.pwszPolicyFile) freeHeap( options.pwszPolicyFile );
+					options.pwszPolicyFile = pwszArgument;
+					pwszArgument = NULL;  // Kept until the end
+					goto next_argument;
+				case 'l':
+					// The log file is the next argument
+					if (pwszArgument[ j + 1 ] ||
+						! getArgument( &pwszArgument, &pwszArgumentIndex )) {
+						printError( L"Missing log file", 0, 0 );
+						errCode = 1;
+						goto done_params;
+					}
+					if (options.pwszLogFile) freeHeap( options.pwszLogFile );
+					options.pwszLogFile = pwszArgument;
+					pwszArgument = NULL;  // Kept until the end
+					goto next_argument;
 				case 'm':
 					options.bMinimize = 1;
 					break;
+				case 'p':
+					// The privilege profile is the next argument
+					if (pwszArgument[ j + 1 ] ||
+						! getArgument( &pwszArgument, &pwszArgumentIndex )) {
+						printError( L"Missing privilege profile", 0, 0 );
+						errCode = 1;
+						goto done_params;
+					}
+					errCode = parsePrivilegeProfile( pwszArgument, &options.privileges );
+					if (errCode) goto done_params;
+					goto next_argument;
+				case 'r':
+					options.bRemovePrivileges = 1;
+					break;
 				case 's':
 					options.bSeamless = 1;
 					break;
 				case 'v':
-					options.bVerbose = 1;
+					if (options.iLogLevel < LOG_TRACE) options.iLogLevel++;
 					break;
 				case 'w':
 					options.bWait = 1;
@@ -283,9 +578,23 @@ int wmain( int argc, wchar_t* argv[] )
 				}
 				j++;
 			}
+		next_argument:;
 		}
 		else {
 			// First non-option argument found
+			if (*pwszArgument == L':') {
+				// Built-in command
+				for (int i = 0; i < sizeof( builtinCommands ) /
+					sizeof( *builtinCommands ); i++) {
+					if (! _wcsicmp( pwszArgument, builtinCommands[ i ].pcwszName )) {
+						freeHeap( pwszArgument );
+						return getExitCode( runBuiltinCommand( i ) );
+					}
+				}
+				printError( L"Invalid built-in command", 0, 0 );
+				errCode = 1;
+				goto done_params;
+			}
 			pwszCommandLine = pwszArgumentIndex;
 			break;
 		}
@@ -304,18 +613,28 @@ done_params:
 
 	if (! pwszCommandLine) pwszCommandLine = L"cmd.exe";
 
-	printFmtVerbose( L"[D] Your command line is '%ls'\n", pwszCommandLine );
-
-	// pwszCommandLine may be read-only. It must be copied to a writable area.
-	size_t nCommandLineBufSize = (wcslen( pwszCommandLine ) + 1) * sizeof( wchar_t );
-	wchar_t* pwszImageName = allocHeap( 0, nCommandLineBufSize );
-	memcpy( pwszImageName, pwszCommandLine, nCommandLineBufSize );
-
-	errCode = acquireSeDebugPrivilege();
-	if (! errCode && options.bSeamless) errCode = createSystemContext();
-	if (! errCode) errCode = createChildProcess( pwszImageName );
+	errCode = startLogging();
+	if (! errCode) {
+		logDebug( L"Your command line is '%ls'", pwszCommandLine );
+		// The image is read while TrustedInstaller is started
+		if (options.bPrefetch) prefetchStart( pwszCommandLine );
+		errCode = acquireSeDebugPrivilege();
+	}
+	if (! errCode && options.nVariables) {
+		// Built once, sorted as CreateProcess expects it
+		options.pwszEnvironment = buildEnvironmentBlock( options.ppwszVariables,
+			options.nVariables );
+		if (! options.pwszEnvironment) {
+			printError( L"Failed to read the environment", GetLastError(), 0 );
+			errCode = 5;
+		}
+	}
+	if (! errCode) errCode = createChildProcess( pwszCommandLine );
+	prefetchStop();
+	stopLogging();
 
-	freeHeap( pwszImageName );
+	if (options.pwszPolicyFile) freeHeap( options.pwszPolicyFile );
+	freeEnvironmentOptions();
 
 	return getExitCode( errCode );
 }
@@ -0,0 +1,323 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	svcops.c
+
+	Built-in service control
+
+	Services are controlled by superUser itself on a thread impersonating the
+	TrustedInstaller token, instead of creating sc.exe for each operation.
+	Waits for a service state are event-driven: the SCM notifies the state
+	changes (NotifyServiceStatusChange) with an APC delivered to this thread.
+
+*/
+
+#include <windows.h>
+#include <stdlib.h>
+
+#include "utils.h" // Utility functions
+
+// Default timeout of the waits for a service state (in milliseconds)
+#define SERVICE_WAIT_TIMEOUT 30000
+
+static SC_HANDLE hSCManager = NULL;
+static DWORD dwWaitTimeout = SERVICE_WAIT_TIMEOUT;
+
+// Notification buffer. The SCM writes to it until the callback is run or
+// the service handle is closed, so it lives as long as the program.
+static struct {
+	SERVICE_NOTIFY notify;
+	volatile BOOL bNotified;
+} serviceWait;
+
+static const wchar_t* apcwszStates[] = {
+	L"UNKNOWN",
+	L"STOPPED",
+	L"START_PENDING",
+	L"STOP_PENDING",
+	L"RUNNING",
+	L"CONTINUE_PENDING",
+	L"PAUSE_PENDING",
+	L"PAUSED"
+};
+
+static const struct {
+	const wchar_t* pcwszName;
+	DWORD dwStartType;
+	BOOL bDelayed;
+} startTypes[] = {
+	{ L"boot", SERVICE_BOOT_START, FALSE },
+	{ L"system", SERVICE_SYSTEM_START, FALSE },
+	{ L"auto", SERVICE_AUTO_START, FALSE },
+	{ L"delayed-auto", SERVICE_AUTO_START, TRUE },
+	{ L"demand", SERVICE_DEMAND_START, FALSE },
+	{ L"disabled", SERVICE_DISABLED, FALSE }
+};
+
+
+static int serviceError( const wchar_t* pwszMessage, DWORD dwCode )
+{
+	printError( pwszMessage, dwCode, 0 );
+	return 7;
+}
+
+
+static const wchar_t* stateName( DWORD dwState )
+{
+	if (dwState >= sizeof( apcwszStates ) / sizeof( *apcwszStates )) dwState = 0;
+	return apcwszStates[ dwState ];
+}
+
+
+static VOID CALLBACK serviceNotifyCallback( PVOID pParameter )
+{
+	serviceWait.bNotified = TRUE;
+}
+
+
+//
+// Wait for a service to reach a state (SERVICE_RUNNING or SERVICE_STOPPED).
+//
+// The notification is queued at once if the service is already in one of the
+// requested states, so there is no polling. The service handle must be closed
+// with closeService.
+//
+static DWORD waitServiceState( SC_HANDLE hService, DWORD dwState )
+{
+	SERVICE_NOTIFY* pNotify = &serviceWait.notify;
+	DWORD dwMask = SERVICE_NOTIFY_STOPPED;
+	if (dwState == SERVICE_RUNNING) dwMask |= SERVICE_NOTIFY_RUNNING;
+
+	DWORD dwStart = GetTickCount();
+	for (;;) {
+		serviceWait.bNotified = FALSE;
+		ZeroMemory( pNotify, sizeof( SERVICE_NOTIFY ) );
+		pNotify->dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+		pNotify->pfnNotifyCallback = serviceNotifyCallback;
+
+		DWORD dwResult = NotifyServiceStatusChange( hService, dwMask, pNotify );
+		if (dwResult != ERROR_SUCCESS) return dwResult;
+
+		// The callback is run as an APC during the alertable wait
+		while (! serviceWait.bNotified) {
+			DWORD dwElapsed = GetTickCount() - dwStart;
+			if (dwElapsed >= dwWaitTimeout) return WAIT_TIMEOUT;
+			SleepEx( dwWaitTimeout - dwElapsed, TRUE );
+		}
+
+		if (pNotify->dwNotificationStatus != ERROR_SUCCESS)
+			return pNotify->dwNotificationStatus;
+
+		DWORD dwCurrentState = pNotify->ServiceStatus.dwCurrentState;
+		if (dwCurrentState == dwState) return ERROR_SUCCESS;
+		if (dwCurrentState == SERVICE_STOPPED) {
+			// The service failed to start
+			DWORD dwExitCode = pNotify->ServiceStatus.dwWin32ExitCode;
+			if (dwExitCode == ERROR_SERVICE_SPECIFIC_ERROR)
+				dwExitCode = pNotify->ServiceStatus.dwServiceSpecificExitCode;
+			return dwExitCode ? dwExitCode : ERROR_SERVICE_NOT_ACTIVE;
+		}
+	}
+}
+
+
+//
+// Close a service handle, cancelling its pending notification if any.
+//
+static void closeService( SC_HANDLE hService )
+{
+	CloseServiceHandle( hService );
+	// Run a notification callback that may have been queued in the meantime
+	SleepEx( 0, TRUE );
+}
+
+
+static int queryVerb( wchar_t** argv )
+{
+	SC_HANDLE hService = OpenService( hSCManager, argv[ 0 ],
+		SERVICE_QUERY_STATUS | SERVICE_QUERY_CONFIG );
+	if (! hService) return serviceError( L"Failed to open service", GetLastError() );
+
+	DWORD dwLastError = 0;
+	SERVICE_STATUS_PROCESS status;
+	DWORD dwBytesNeeded = 0;
+	QUERY_SERVICE_CONFIG* pConfig = NULL;
+
+	if (QueryServiceStatusEx( hService, SC_STATUS_PROCESS_INFO, (LPBYTE) &status,
+		sizeof( status ), &dwBytesNeeded )) {
+		QueryServiceConfig( hService, NULL, 0, &dwBytesNeeded );
+		if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+			pConfig = allocHeap( 0, dwBytesNeeded );
+			if (! QueryServiceConfig( hService, pConfig, dwBytesNeeded, &dwBytesNeeded ))
+				dwLastError = GetLastError();
+		}
+		else dwLastError = GetLastError();
+	}
+	else dwLastError = GetLastError();
+
+	if (! dwLastError) {
+		const wchar_t* pcwszStartType = L"unknown";
+		for (int i = 0; i < sizeof( startTypes ) / sizeof( *startTypes ); i++)
+			if (startTypes[ i ].dwStartType == pConfig->dwStartType) {
+				pcwszStartType = startTypes[ i ].pcwszName;
+				break;
+			}
+
+		printFmtConsole( L"%ls\n  State: %ls\n  PID: %lu\n  Start type: %ls\n"
+			L"  Binary path: %ls\n", argv[ 0 ], stateName( status.dwCurrentState ),
+			status.dwProcessId, pcwszStartType,
+			pConfig->lpBinaryPathName ? pConfig->lpBinaryPathName : L"" );
+	}
+
+	if (pConfig) freeHeap( pConfig );
+	CloseServiceHandle( hService );
+
+	if (dwLastError) return serviceError( L"Failed to query service", dwLastError );
+	return 0;
+}
+
+
+static int startVerb( wchar_t** argv )
+{
+	SC_HANDLE hService = OpenService( hSCManager, argv[ 0 ],
+		SERVICE_QUERY_STATUS | SERVICE_START );
+	if (! hService) return serviceError( L"Failed to open service", GetLastError() );
+
+	DWORD dwResult = ERROR_SUCCESS;
+	if (! StartService( hService, 0, NULL )) {
+		dwResult = GetLastError();
+		if (dwResult == ERROR_SERVICE_ALREADY_RUNNING) dwResult = ERROR_SUCCESS;
+	}
+
+	if (dwResult == ERROR_SUCCESS) dwResult = waitServiceState( hService, SERVICE_RUNNING );
+	closeService( hService );
+
+	if (dwResult != ERROR_SUCCESS) return serviceError( L"Failed to start service", dwResult );
+	return 0;
+}
+
+
+static int stopVerb( wchar_t** argv )
+{
+	SC_HANDLE hService = OpenService( hSCManager, argv[ 0 ],
+		SERVICE_QUERY_STATUS | SERVICE_STOP );
+	if (! hService) return serviceError( L"Failed to open service", GetLastError() );
+
+	DWORD dwResult = ERROR_SUCCESS;
+	SERVICE_STATUS status;
+	if (! ControlService( hService, SERVICE_CONTROL_STOP, &status )) {
+		dwResult = GetLastError();
+		// Already stopped, or stopping
+		if (dwResult == ERROR_SERVICE_NOT_ACTIVE ||
+			(dwResult == ERROR_SERVICE_CANNOT_ACCEPT_CTRL &&
+				status.dwCurrentState == SERVICE_STOP_PENDING))
+			dwResult = ERROR_SUCCESS;
+	}
+
+	if (dwResult == ERROR_SUCCESS) dwResult = waitServiceState( hService, SERVICE_STOPPED );
+	closeService( hService );
+
+	if (dwResult != ERROR_SUCCESS) return serviceError( L"Failed to stop service", dwResult );
+	return 0;
+}
+
+
+// Index of a start type in startTypes, or -1 (logged) if it is invalid
+static int findStartType( const wchar_t* pcwszName )
+{
+	for (int i = 0; i < sizeof( startTypes ) / sizeof( *startTypes ); i++)
+		if (! _wcsicmp( pcwszName, startTypes[ i ].pcwszName )) return i;
+	printError( L"Invalid service start type", 0, 0 );
+	return -1;
+}
+
+
+static int checkStarttypeVerb( wchar_t** argv )
+{
+	return (findStartType( argv[ 1 ] ) < 0) ? 1 : 0;
+}
+
+
+static int starttypeVerb( wchar_t** argv )
+{
+	int iType = findStartType( argv[ 1 ] );
+	if (iType < 0) return 1;
+
+	SC_HANDLE hService = OpenService( hSCManager, argv[ 0 ], SERVICE_CHANGE_CONFIG );
+	if (! hService) return serviceError( L"Failed to open service", GetLastError() );
+
+	BOOL bSuccess = ChangeServiceConfig( hService, SERVICE_NO_CHANGE,
+		startTypes[ iType ].dwStartType, SERVICE_NO_CHANGE, NULL, NULL, NULL, NULL, NULL,
+		NULL, NULL );
+	if (bSuccess && startTypes[ iType ].dwStartType == SERVICE_AUTO_START) {
+		SERVICE_DELAYED_AUTO_START_INFO delayedInfo = { startTypes[ iType ].bDelayed };
+		bSuccess = ChangeServiceConfig2( hService, SERVICE_CONFIG_DELAYED_AUTO_START_INFO,
+			&delayedInfo );
+	}
+	DWORD dwLastError = bSuccess ? 0 : GetLastError();
+	CloseServiceHandle( hService );
+
+	if (! bSuccess) return serviceError( L"Failed to set service start type", dwLastError );
+	return 0;
+}
+
+
+static int binpathVerb( wchar_t** argv )
+{
+	SC_HANDLE hService = OpenService( hSCManager, argv[ 0 ], SERVICE_CHANGE_CONFIG );
+	if (! hService) return serviceError( L"Failed to open service", GetLastError() );
+
+	BOOL bSuccess = ChangeServiceConfig( hService, SERVICE_NO_CHANGE, SERVICE_NO_CHANGE,
+		SERVICE_NO_CHANGE, argv[ 1 ], NULL, NULL, NULL, NULL, NULL, NULL );
+	DWORD dwLastError = bSuccess ? 0 : GetLastError();
+	CloseServiceHandle( hService );
+
+	if (! bSuccess) return serviceError( L"Failed to set service binary path", dwLastError );
+	return 0;
+}
+
+
+static int checkTimeoutVerb( wchar_t** argv )
+{
+	DWORD dwSeconds;
+	return parseNumberArgument( argv[ 0 ], L"timeout in seconds", 0, MAXDWORD / 1000,
+		&dwSeconds );
+}
+
+
+static int timeoutVerb( wchar_t** argv )
+{
+	// Timeout of the following waits, in seconds
+	DWORD dwSeconds;
+	int errCode = parseNumberArgument( argv[ 0 ], L"timeout in seconds", 0,
+		MAXDWORD / 1000, &dwSeconds );
+	if (! errCode) dwWaitTimeout = dwSeconds * 1000;
+	return errCode;
+}
+
+
+static const VERB serviceVerbs[] = {
+	{ L"query", 1, queryVerb },
+	{ L"start", 1, startVerb },
+	{ L"stop", 1, stopVerb },
+	{ L"starttype", 2, starttypeVerb, checkStarttypeVerb },
+	{ L"binpath", 2, binpathVerb },
+	{ L"timeout", 1, timeoutVerb, checkTimeoutVerb }
+};
+
+
+int runServiceCommand( int argc, wchar_t** argv )
+{
+	// The SCM connection is shared by all the operations
+	hSCManager = OpenSCManager( NULL, NULL, SC_MANAGER_CONNECT );
+	if (! hSCManager) return serviceError( L"Failed to open SCM", GetLastError() );
+
+	int errCode = runVerbs( serviceVerbs, sizeof( serviceVerbs ) / sizeof( *serviceVerbs ),
+		argc, argv );
+
+	CloseServiceHandle( hSCManager );
+	hSCManager = NULL;
+	return errCode;
+}
@@ -0,0 +1,947 @@
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	tarops.c
+
+	Built-in backup archiver
+
+	Collects protected files (registry hive backups, locked logs...) without
+	creating a process per file: they are opened with the backup semantics,
+	granted by the SeBackupPrivilege of the TrustedInstaller token, and streamed
+	as a single tar archive (pax format for the long and non-ASCII names and
+	the files of 8 GB or more) to a file or to standard output. Symbolic links
+	and junctions are stored as symbolic link entries, not followed.
+
+	The tree is enumerated first. Then a pool of reader threads opens the files
+	in parallel and reads them with large overlapped reads, each one into its
+	own pair of buffers: one is read while the other is written. The calling
+	thread writes the buffers in the order of the archive. The buffers are
+	allocated once, whatever the number of files.
+
+*/
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+
+#include "utils.h" // Utility functions
+#include "log.h"   // Leveled logging
+
+#define CHUNK_SIZE (1024 * 1024)    // Size of a read
+#define OUTPUT_SIZE (256 * 1024)    // Output buffer (headers and small files)
+#define BLOCK_SIZE 512
+
+// Largest size of a ustar header (11 octal digits)
+#define MAX_USTAR_SIZE 077777777777ULL
+
+// UTF-8 name of an entry (3 bytes per UTF-16 unit at most)
+#define NAME_SIZE (MAX_LONG_PATH * 3 + 2)
+
+// UTF-8 target of a link (its reparse data holds less than 8K UTF-16 units)
+#define LINK_SIZE (MAXIMUM_REPARSE_DATA_BUFFER_SIZE / 2 * 3)
+
+// Headers of an entry: pax header, its records, ustar header
+#define HEADER_SIZE (BLOCK_SIZE * 2 + \
+	((NAME_SIZE + LINK_SIZE + 128 + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1)))
+
+// Difference between the FILETIME and Unix epochs (100 ns intervals)
+#define EPOCH_DIFFERENCE 116444736000000000ULL
+
+typedef struct {
+	char name[ 100 ];
+	char mode[ 8 ];
+	char uid[ 8 ];
+	char gid[ 8 ];
+	char size[ 12 ];
+	char mtime[ 12 ];
+	char chksum[ 8 ];
+	char typeflag;
+	char linkname[ 100 ];
+	char magic[ 6 ];
+	char version[ 2 ];
+	char uname[ 32 ];
+	char gname[ 32 ];
+	char devmajor[ 8 ];
+	char devminor[ 8 ];
+	char prefix[ 155 ];
+	char pad[ 12 ];
+} TAR_HEADER;
+
+// Reparse data of the symbolic links and junctions (REPARSE_DATA_BUFFER of the
+// DDK). Their path buffer follows the flags of a symbolic link, and the print
+// name length of a junction. The offsets are relative to the path buffer.
+typedef struct {
+	DWORD dwTag;
+	WORD nDataLength;
+	WORD wReserved;
+	WORD nSubstituteNameOffset;  // In bytes
+	WORD nSubstituteNameLength;
+	WORD nPrintNameOffset;
+	WORD nPrintNameLength;
+	DWORD dwFlags;               // Symbolic links only
+} LINK_REPARSE_DATA;
+
+// Entry states
+#define ENTRY_PENDING 0  // Not opened yet
+#define ENTRY_OPENED 1   // Size known, its chunks are being read
+#define ENTRY_FAILED 2   // Could not be opened, not archived
+
+// File or directory to archive
+typedef struct {
+	size_t nPathOffset;  // In the path buffer
+	DWORD nPathLen;
+	DWORD dwAttributes;
+	FILETIME lastWriteTime;
+	ULONGLONG nSize;     // Set when the file is opened
+	char* pszLinkName;   // Target of a link (UTF-8), set when it is opened
+	int iState;
+	int iReader;         // Reader of the entry
+} ENTRY;
+
+typedef struct {
+	BYTE* pData;
+	DWORD nLength;
+	BOOL bReady;         // Read, waiting to be written
+	BOOL bPending;       // Read in progress
+	OVERLAPPED overlapped;
+} BUFFER;
+
+// Each reader fills its buffers alternately, and the writer empties them in
+// the same order.
+typedef struct {
+	BUFFER buffers[ 2 ];
+	int iFill;
+	int iWrite;
+} READER;
+
+static struct {
+	// Settings
+	int nThreads;
+	HANDLE hOutput;
+	BOOL bCloseOutput;
+	BOOL bBroken;     // A write failed: the archive cannot be terminated
+
+	// Entries of the path being added, and their full paths
+	ENTRY* pEntries;
+	size_t nEntries, nEntriesCapacity;
+	wchar_t* pPaths;
+	size_t nPathsSize, nPathsCapacity;  // In characters
+	size_t nRootLen;  // Length of the prefix removed from the archived names
+
+	// Engine
+	HANDLE hToken;    // Impersonation token of the readers
+	READER* pReaders;
+	CRITICAL_SECTION lock;     // Protects the entry states and the buffers
+	CONDITION_VARIABLE changed;
+	size_t iNextEntry;         // Next entry to be taken by a reader
+	BOOL bStop;
+
+	// Writer
+	BYTE* pOutput;
+	DWORD nOutput;
+	char* pszName;
+	BYTE* pHeader;
+
+	// Counters
+	ULONGLONG nBytes;
+	LONG nFiles, nDirectories, nLinks;
+	volatile LONG nErrors;
+} tar;
+
+static const BYTE zeroBlock[ BLOCK_SIZE ];
+
+
+static void reportError( const wchar_t* pwszPath, DWORD dwError )
+{
+	InterlockedIncrement( &tar.nErrors );
+	printError( pwszPath, dwError, 0 );
+}
+
+
+static void addEntry( const wchar_t* pwszPath, size_t nPathLen, DWORD dwAttributes,
+	FILETIME lastWriteTime )
+{
+	// The tables grow by doubling, not per entry
+	if (tar.nEntries == tar.nEntriesCapacity) {
+		tar.nEntriesCapacity = tar.nEntriesCapacity ? tar.nEntriesCapacity * 2 : 1024;
+		ENTRY* pEntries = allocHeap( 0, tar.nEntriesCapacity * sizeof( ENTRY ) );
+		if (tar.pEntries) {
+			memcpy( pEntries, tar.pEntries, tar.nEntries * sizeof( ENTRY ) );
+			freeHeap( tar.pEntries );
+		}
+		tar.pEntries = pEntries;
+	}
+	if (tar.nPathsSize + nPathLen + 1 > tar.nPathsCapacity) {
+		do tar.nPathsCapacity = tar.nPathsCapacity ? tar.nPathsCapacity * 2 : 65536;
+		while (tar.nPathsSize + nPathLen + 1 > tar.nPathsCapacity);
+		wchar_t* pPaths = allocHeap( 0, tar.nPathsCapacity * sizeof( wchar_t ) );
+		if (tar.pPaths) {
+			memcpy( pPaths, tar.pPaths, tar.nPathsSize * sizeof( wchar_t ) );
+			freeHeap( tar.pPaths );
+		}
+		tar.pPaths = pPaths;
+	}
+
+	ENTRY* pEntry = &tar.pEntries[ tar.nEntries++ ];
+	pEntry->nPathOffset = tar.nPathsSize;
+	pEntry->nPathLen = (DWORD) nPathLen;
+	pEntry->dwAttributes = dwAttributes;
+	pEntry->lastWriteTime = lastWriteTime;
+	pEntry->nSize = 0;
+	pEntry->pszLinkName = NULL;
+	pEntry->iState = ENTRY_PENDING;
+	pEntry->iReader = -1;
+
+	memcpy( tar.pPaths + tar.nPathsSize, pwszPath, nPathLen * sizeof( wchar_t ) );
+	tar.pPaths[ tar.nPathsSize + nPathLen ] = L'\0';
+	tar.nPathsSize += nPathLen + 1;
+}
+
+
+//
+// Add the entries of a directory. pwszPath is a work buffer (MAX_LONG_PATH
+// characters). pwszDirectory can point to the path buffer, which can move
+// when entries are added: it is copied first.
+//
+static void enumerateDirectory( const wchar_t* pwszDirectory, size_t nDirLen,
+	wchar_t* pwszPath )
+{
+	memcpy( pwszPath, pwszDirectory, nDirLen * sizeof( wchar_t ) );
+	size_t nLen = nDirLen;
+	if (pwszPath[ nLen - 1 ] != L'\\') pwszPath[ nLen++ ] = L'\\';
+	pwszPath[ nLen ] = L'*';
+	pwszPath[ nLen + 1 ] = L'\0';
+
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = findFirstEntry( pwszPath, &findData );
+	if (hFind == INVALID_HANDLE_VALUE) {
+		DWORD dwError = GetLastError();
+		pwszPath[ nDirLen ] = L'\0';
+		if (dwError != ERROR_FILE_NOT_FOUND) reportError( pwszPath, dwError );
+		return;
+	}
+
+	do {
+		const wchar_t* pwszName = findData.cFileName;
+		if (pwszName[ 0 ] == L'.' && (! pwszName[ 1 ] ||
+			(pwszName[ 1 ] == L'.' && ! pwszName[ 2 ])))
+			continue;
+
+		size_t nNameLen = wcslen( pwszName );
+		if (nLen + nNameLen >= MAX_LONG_PATH) {
+			wchar_t cSeparator = pwszPath[ nDirLen ];
+			pwszPath[ nDirLen ] = L'\0';
+			reportError( pwszPath, ERROR_FILENAME_EXCED_RANGE );
+			pwszPath[ nDirLen ] = cSeparator;
+			continue;
+		}
+		memcpy( pwszPath + nLen, pwszName, (nNameLen + 1) * sizeof( wchar_t ) );
+		addEntry( pwszPath, nLen + nNameLen, findData.dwFileAttributes,
+			findData.ftLastWriteTime );
+	} while (FindNextFile( hFind, &findData ));
+
+	DWORD dwError = GetLastError();
+	pwszPath[ nDirLen ] = L'\0';
+	if (dwError != ERROR_NO_MORE_FILES) reportError( pwszPath, dwError );
+	FindClose( hFind );
+}
+
+
+static BOOL isDirectoryToWalk( DWORD dwAttributes )
+{
+	// Junctions and directory symbolic links are archived as links, not followed
+	return (dwAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) ==
+		FILE_ATTRIBUTE_DIRECTORY;
+}
+
+
+static void setEntryState( ENTRY* pEntry, int iState )
+{
+	EnterCriticalSection( &tar.lock );
+	pEntry->iState = iState;
+	WakeAllConditionVariable( &tar.changed );
+	LeaveCriticalSection( &tar.lock );
+}
+
+
+static int waitEntry( ENTRY* pEntry )
+{
+	EnterCriticalSection( &tar.lock );
+	while (pEntry->iState == ENTRY_PENDING)
+		SleepConditionVariableCS( &tar.changed, &tar.lock, INFINITE );
+	int iState = pEntry->iState;
+	LeaveCriticalSection( &tar.lock );
+	return iState;
+}
+
+
+static void setBufferReady( BUFFER* pBuffer, BOOL bReady )
+{
+	EnterCriticalSection( &tar.lock );
+	pBuffer->bReady = bReady;
+	WakeAllConditionVariable( &tar.changed );
+	LeaveCriticalSection( &tar.lock );
+}
+
+
+//
+// Wait until a buffer is ready (writer) or written (reader).
+// Return FALSE if the archive is stopped.
+//
+static BOOL waitBuffer( BUFFER* pBuffer, BOOL bReady )
+{
+	EnterCriticalSection( &tar.lock );
+	while (pBuffer->bReady != bReady && ! tar.bStop)
+		SleepConditionVariableCS( &tar.changed, &tar.lock, INFINITE );
+	BOOL bStop = tar.bStop;
+	LeaveCriticalSection( &tar.lock );
+	return ! bStop;
+}
+
+
+static void stopReaders( void )
+{
+	EnterCriticalSection( &tar.lock );
+	tar.bStop = TRUE;
+	WakeAllConditionVariable( &tar.changed );
+	LeaveCriticalSection( &tar.lock );
+}
+
+
+//
+// Start reading a chunk into a buffer, unless a previous read of the file
+// failed. Return the error that stops the reads of the file.
+//
+static DWORD startRead( HANDLE hFile, BUFFER* pBuffer, ULONGLONG nOffset, DWORD dwError )
+{
+	pBuffer->bPending = FALSE;
+	if (dwError) return dwError;
+
+	pBuffer->overlapped.Offset = (DWORD) nOffset;
+	pBuffer->overlapped.OffsetHigh = (DWORD) (nOffset >> 32);
+	if (ReadFile( hFile, pBuffer->pData, pBuffer->nLength, NULL, &pBuffer->overlapped ) ||
+		GetLastError() == ERROR_IO_PENDING) {
+		pBuffer->bPending = TRUE;
+		return 0;
+	}
+	dwError = GetLastError();
+	return (dwError == ERROR_HANDLE_EOF) ? 0 : dwError;
+}
+
+
+//
+// Wait for the read of a buffer and hand it to the writer.
+//
+static DWORD completeRead( HANDLE hFile, BUFFER* pBuffer, DWORD dwError )
+{
+	DWORD nRead = 0;
+	if (pBuffer->bPending &&
+		! GetOverlappedResult( hFile, &pBuffer->overlapped, &nRead, TRUE )) {
+		DWORD dwReadError = GetLastError();
+		if (dwReadError != ERROR_HANDLE_EOF && ! dwError) dwError = dwReadError;
+	}
+
+	// The size is already in the header: the part of a file truncated meanwhile,
+	// or that could not be read, is replaced with zeros
+	if (nRead < pBuffer->nLength)
+		memset( pBuffer->pData + nRead, 0, pBuffer->nLength - nRead );
+
+	setBufferReady( pBuffer, TRUE );
+	return dwError;
+}
+
+
+//
+// Read the target of a symbolic link or junction, without following it, into
+// pEntry->pszLinkName (with '/' separators).
+// Return ERROR_NOT_A_REPARSE_POINT for the other reparse points (compressed,
+// deduplicated files...): their data is archived.
+//
+static DWORD readLink( ENTRY* pEntry, const wchar_t* pwszPath )
+{
+	HANDLE hFile = CreateFile( pwszPath, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL );
+	if (hFile == INVALID_HANDLE_VALUE) return GetLastError();
+
+	LINK_REPARSE_DATA* pData = allocHeap( 0, MAXIMUM_REPARSE_DATA_BUFFER_SIZE );
+	DWORD nReturned;
+	DWORD dwError = DeviceIoControl( hFile, FSCTL_GET_REPARSE_POINT, NULL, 0, pData,
+		MAXIMUM_REPARSE_DATA_BUFFER_SIZE, &nReturned, NULL ) ? 0 : GetLastError();
+	CloseHandle( hFile );
+
+	size_t nPathOffset = 0;
+	if (! dwError) {
+		if (pData->dwTag == IO_REPARSE_TAG_SYMLINK)
+			nPathOffset = sizeof( LINK_REPARSE_DATA );
+		else if (pData->dwTag == IO_REPARSE_TAG_MOUNT_POINT)
+			nPathOffset = sizeof( LINK_REPARSE_DATA ) - sizeof( DWORD );
+		else dwError = ERROR_NOT_A_REPARSE_POINT;
+	}
+	if (! dwError && nReturned < nPathOffset) dwError = ERROR_INVALID_REPARSE_DATA;
+
+	if (! dwError) {
+		// The print name is the target as it was given. Some junctions only have
+		// the NT path ("\??\C:\...").
+		const wchar_t* pPathBuffer = (const wchar_t*) ((BYTE*) pData + nPathOffset);
+		size_t nPathBufferSize = nReturned - nPathOffset;
+		size_t nOffset = pData->nPrintNameOffset;
+		size_t nLength = pData->nPrintNameLength;
+		if (! nLength) {
+			nOffset = pData->nSubstituteNameOffset;
+			nLength = pData->nSubstituteNameLength;
+		}
+		if (nOffset + nLength > nPathBufferSize) nLength = 0;
+		const wchar_t* pName = (const wchar_t*) ((BYTE*) pPathBuffer + nOffset);
+		if (nLength > 8 && ! memcmp( pName, L"\\??\\", 8 )) {
+			pName += 4;
+			nLength -= 8;
+		}
+
+		int nLinkLen = nLength ? WideCharToMultiByte( CP_UTF8, 0, pName, (int) (nLength / 2),
+			NULL, 0, NULL, NULL ) : 0;
+		if (nLinkLen) {
+			char* pszLinkName = allocHeap( 0, nLinkLen + 1 );
+			WideCharToMultiByte( CP_UTF8, 0, pName, (int) (nLength / 2), pszLinkName,
+				nLinkLen, NULL, NULL );
+			pszLinkName[ nLinkLen ] = '\0';
+			for (char* p = pszLinkName; *p; p++) if (*p == '\\') *p = '/';
+			pEntry->pszLinkName = pszLinkName;
+		}
+		else dwError = ERROR_INVALID_REPARSE_DATA;
+	}
+
+	freeHeap( pData );
+	return dwError;
+}
+
+
+static void readEntry( READER* pReader, ENTRY* pEntry )
+{
+	const wchar_t* pwszPath = tar.pPaths + pEntry->nPathOffset;
+
+	if (pEntry->dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+		DWORD dwError = readLink( pEntry, pwszPath );
+		if (dwError != ERROR_NOT_A_REPARSE_POINT) {
+			if (dwError) reportError( pwszPath, dwError );
+			setEntryState( pEntry, dwError ? ENTRY_FAILED : ENTRY_OPENED );
+			return;
+		}
+	}
+
+	if (pEntry->dwAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		setEntryState( pEntry, ENTRY_OPENED );
+		return;
+	}
+
+	HANDLE hFile = CreateFile( pwszPath, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	LARGE_INTEGER size;
+	if (hFile == INVALID_HANDLE_VALUE || ! GetFileSizeEx( hFile, &size )) {
+		reportError( pwszPath, GetLastError() );
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle( hFile );
+		setEntryState( pEntry, ENTRY_FAILED );
+		return;
+	}
+	pEntry->nSize = size.QuadPart;
+	setEntryState( pEntry, ENTRY_OPENED );
+
+	// Two reads in flight: the next chunk is requested before waiting for the
+	// previous one
+	BUFFER* pPrevious = NULL;
+	DWORD dwError = 0;
+	for (ULONGLONG nOffset = 0; nOffset < pEntry->nSize; nOffset += CHUNK_SIZE) {
+		BUFFER* pBuffer = &pReader->buffers[ pReader->iFill ];
+		pReader->iFill ^= 1;
+		if (! waitBuffer( pBuffer, FALSE )) break;
+
+		ULONGLONG nRemaining = pEntry->nSize - nOffset;
+		pBuffer->nLength = (nRemaining < CHUNK_SIZE) ? (DWORD) nRemaining : CHUNK_SIZE;
+		dwError = startRead( hFile, pBuffer, nOffset, dwError );
+		if (pPrevious) dwError = completeRead( hFile, pPrevious, dwError );
+		pPrevious = pBuffer;
+	}
+	if (pPrevious) dwError = completeRead( hFile, pPrevious, dwError );
+
+	if (dwError) reportError( pwszPath, dwError );
+	CloseHandle( hFile );
+}
+
+
+static DWORD WINAPI tarReader( LPVOID pParameter )
+{
+	int iReader = (int) (INT_PTR) pParameter;
+	SetThreadToken( NULL, tar.hToken );
+
+	for (;;) {
+		// Take the next entry
+		EnterCriticalSection( &tar.lock );
+		size_t i = tar.iNextEntry;
+		BOOL bDone = tar.bStop || i >= tar.nEntries;
+		if (! bDone) {
+			tar.iNextEntry++;
+			tar.pEntries[ i ].iReader = iReader;
+		}
+		LeaveCriticalSection( &tar.lock );
+		if (bDone) break;
+
+		readEntry( &tar.pReaders[ iReader ], &tar.pEntries[ i ] );
+	}
+
+	return 0;
+}
+
+
+static BOOL flushOutput( void )
+{
+	DWORD nWritten;
+	BOOL bSuccess = ! tar.nOutput ||
+		(WriteFile( tar.hOutput, tar.pOutput, tar.nOutput, &nWritten, NULL ) &&
+			nWritten == tar.nOutput);
+	tar.nOutput = 0;
+	return bSuccess;
+}
+
+
+//
+// Write to the archive. The small writes (headers, small files, padding) are
+// gathered in the output buffer, the large ones are written directly.
+//
+static BOOL writeOutput( const void* pData, DWORD nLength )
+{
+	if (nLength >= OUTPUT_SIZE / 4) {
+		DWORD nWritten;
+		return flushOutput() && WriteFile( tar.hOutput, pData, nLength, &nWritten, NULL ) &&
+			nWritten == nLength;
+	}
+	if (tar.nOutput + nLength > OUTPUT_SIZE && ! flushOutput()) return FALSE;
+	memcpy( tar.pOutput + tar.nOutput, pData, nLength );
+	tar.nOutput += nLength;
+	return TRUE;
+}
+
+
+static int formatDecimal( char* pBuffer, ULONGLONG nValue )
+{
+	char digits[ 20 ];
+	int nDigits = 0;
+	do digits[ nDigits++ ] = '0' + nValue % 10;
+	while (nValue /= 10);
+	for (int i = 0; i < nDigits; i++) pBuffer[ i ] = digits[ nDigits - 1 - i ];
+	return nDigits;
+}
+
+
+//
+// Add a pax record "<length> <keyword>=<value>\n". The length includes its
+// own digits.
+//
+static size_t addPaxRecord( char* pRecord, const char* pszKeyword, const char* pValue,
+	size_t nValueLen )
+{
+	char digits[ 20 ];
+	size_t nKeywordLen = strlen( pszKeyword );
+	size_t nLen = nKeywordLen + nValueLen + 3;
+	int nDigits = formatDecimal( digits, nLen );
+	if (formatDecimal( digits, nLen + nDigits ) > nDigits) nDigits++;
+	nLen += nDigits;
+
+	char* p = pRecord + formatDecimal( pRecord, nLen );
+	*p++ = ' ';
+	memcpy( p, pszKeyword, nKeywordLen );
+	p += nKeywordLen;
+	*p++ = '=';
+	memcpy( p, pValue, nValueLen );
+	p[ nValueLen ] = '\n';
+	return nLen;
+}
+
+
+// Octal number of nSize - 1 digits, followed by a NUL
+static void setOctal( char* pField, int nSize, ULONGLONG nValue )
+{
+	pField[ nSize - 1 ] = '\0';
+	for (int i = nSize - 1; i-- > 0; nValue >>= 3) pField[ i ] = '0' + (nValue & 7);
+}
+
+
+static void fillHeader( TAR_HEADER* pHeader, const char* pName, size_t nNameLen,
+	ULONGLONG nSize, ULONGLONG nTime, char cType, const char* pLinkName, size_t nLinkLen )
+{
+	memset( pHeader, 0, sizeof( *pHeader ) );
+	memcpy( pHeader->name, pName, (nNameLen < sizeof( pHeader->name )) ? nNameLen :
+		sizeof( pHeader->name ) );
+	memcpy( pHeader->linkname, pLinkName, (nLinkLen < sizeof( pHeader->linkname )) ?
+		nLinkLen : sizeof( pHeader->linkname ) );
+	setOctal( pHeader->mode, sizeof( pHeader->mode ),
+		(cType == '5') ? 0755 : (cType == '2') ? 0777 : 0644 );
+	setOctal( pHeader->uid, sizeof( pHeader->uid ), 0 );
+	setOctal( pHeader->gid, sizeof( pHeader->gid ), 0 );
+	setOctal( pHeader->size, sizeof( pHeader->size ), nSize );
+	setOctal( pHeader->mtime, sizeof( pHeader->mtime ), nTime );
+	pHeader->typeflag = cType;
+	memcpy( pHeader->magic, "ustar", 6 );
+	memcpy( pHeader->version, "00", 2 );
+
+	// The checksum is computed with its own field filled with spaces
+	memset( pHeader->chksum, ' ', sizeof( pHeader->chksum ) );
+	unsigned int nSum = 0;
+	for (int i = 0; i < sizeof( *pHeader ); i++) nSum += ((BYTE*) pHeader)[ i ];
+	setOctal( pHeader->chksum, 7, nSum );
+}
+
+
+static BOOL writeHeader( const ENTRY* pEntry )
+{
+	const char* pszLinkName = pEntry->pszLinkName;
+	BOOL bDirectory = (pEntry->dwAttributes & FILE_ATTRIBUTE_DIRECTORY) && ! pszLinkName;
+
+	// Name relative to the parent of the added path, with '/' separators
+	int nNameLen = WideCharToMultiByte( CP_UTF8, 0,
+		tar.pPaths + pEntry->nPathOffset + tar.nRootLen,
+		(int) (pEntry->nPathLen - tar.nRootLen), tar.pszName, NAME_SIZE - 1, NULL, NULL );
+	BOOL bPaxName = FALSE;
+	for (int i = 0; i < nNameLen; i++) {
+		if (tar.pszName[ i ] == '\\') tar.pszName[ i ] = '/';
+		else if ((BYTE) tar.pszName[ i ] >= 0x80) bPaxName = TRUE;
+	}
+	if (bDirectory) tar.pszName[ nNameLen++ ] = '/';
+	if (nNameLen > sizeof( ((TAR_HEADER*) 0)->name )) bPaxName = TRUE;
+	BOOL bPaxSize = pEntry->nSize > MAX_USTAR_SIZE;
+	size_t nLinkLen = pszLinkName ? strlen( pszLinkName ) : 0;
+	BOOL bPaxLink = nLinkLen > sizeof( ((TAR_HEADER*) 0)->linkname );
+	for (size_t i = 0; i < nLinkLen; i++)
+		if ((BYTE) pszLinkName[ i ] >= 0x80) bPaxLink = TRUE;
+
+	ULONGLONG nTime = (ULONGLONG) pEntry->lastWriteTime.dwHighDateTime << 32 |
+		pEntry->lastWriteTime.dwLowDateTime;
+	nTime = (nTime > EPOCH_DIFFERENCE) ? (nTime - EPOCH_DIFFERENCE) / 10000000 : 0;
+
+	BYTE* p = tar.pHeader;
+	if (bPaxName || bPaxSize || bPaxLink) {
+		// The pax header gives the values that do not fit in the ustar header
+		char* pRecords = (char*) p + BLOCK_SIZE;
+		size_t nRecords = 0;
+		if (bPaxName)
+			nRecords += addPaxRecord( pRecords, "path", tar.pszName, nNameLen );
+		if (bPaxSize) {
+			char szSize[ 20 ];
+			nRecords += addPaxRecord( pRecords + nRecords, "size", szSize,
+				formatDecimal( szSize, pEntry->nSize ) );
+		}
+		if (bPaxLink)
+			nRecords += addPaxRecord( pRecords + nRecords, "linkpath", pszLinkName, nLinkLen );
+		fillHeader( (TAR_HEADER*) p, "././@PaxHeader", 14, nRecords, nTime, 'x', NULL, 0 );
+		size_t nPadded = (nRecords + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+		memset( pRecords + nRecords, 0, nPadded - nRecords );
+		p += BLOCK_SIZE + nPadded;
+	}
+	fillHeader( (TAR_HEADER*) p, tar.pszName, nNameLen, bPaxSize ? 0 : pEntry->nSize,
+		nTime, pszLinkName ? '2' : bDirectory ? '5' : '0', pszLinkName, nLinkLen );
+	p += BLOCK_SIZE;
+
+	return writeOutput( tar.pHeader, (DWORD) (p - tar.pHeader) );
+}
+
+
+//
+// Write the entries in order, as their buffers are read.
+// Return FALSE if the archive could not be written.
+//
+static BOOL writeEntries( void )
+{
+	for (size_t i = 0; i < tar.nEntries; i++) {
+		ENTRY* pEntry = &tar.pEntries[ i ];
+		if (waitEntry( pEntry ) == ENTRY_FAILED) continue;
+
+		BOOL bSuccess = writeHeader( pEntry );
+		READER* pReader = &tar.pReaders[ pEntry->iReader ];
+		for (ULONGLONG nOffset = 0; bSuccess && nOffset < pEntry->nSize;
+			nOffset += CHUNK_SIZE) {
+			BUFFER* pBuffer = &pReader->buffers[ pReader->iWrite ];
+			pReader->iWrite ^= 1;
+			waitBuffer( pBuffer, TRUE );
+			bSuccess = writeOutput( pBuffer->pData, pBuffer->nLength );
+			setBufferReady( pBuffer, FALSE );
+		}
+
+		// The data is padded to a block
+		DWORD nPadding = (DWORD) (0 - pEntry->nSize) & (BLOCK_SIZE - 1);
+		if (bSuccess && nPadding) bSuccess = writeOutput( zeroBlock, nPadding );
+		if (! bSuccess) return FALSE;
+
+		tar.nBytes += pEntry->nSize;
+		if (pEntry->pszLinkName) tar.nLinks++;
+		else if (pEntry->dwAttributes & FILE_ATTRIBUTE_DIRECTORY) tar.nDirectories++;
+		else tar.nFiles++;
+	}
+	return TRUE;
+}
+
+
+//
+// Read the entries with the reader pool and write them to the archive.
+//
+static int runReaders( void )
+{
+	HANDLE ahThreads[ MAXIMUM_WAIT_OBJECTS ];
+	int nThreads = 0;
+
+	BYTE* pBuffers = VirtualAlloc( NULL, (SIZE_T) tar.nThreads * 2 * CHUNK_SIZE,
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+	if (! pBuffers) {
+		printError( L"Failed to allocate the read buffers", GetLastError(), 0 );
+		return 7;
+	}
+
+	tar.pReaders = allocHeap( HEAP_ZERO_MEMORY, tar.nThreads * sizeof( READER ) );
+	for (int i = 0; i < tar.nThreads; i++)
+		for (int j = 0; j < 2; j++) {
+			BUFFER* pBuffer = &tar.pReaders[ i ].buffers[ j ];
+			pBuffer->pData = pBuffers + (SIZE_T) (i * 2 + j) * CHUNK_SIZE;
+			pBuffer->overlapped.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		}
+
+	InitializeCriticalSection( &tar.lock );
+	InitializeConditionVariable( &tar.changed );
+	tar.iNextEntry = 0;
+	tar.bStop = FALSE;
+
+	for (int i = 0; i < tar.nThreads; i++) {
+		ahThreads[ nThreads ] = CreateThread( NULL, 64 * 1024, tarReader,
+			(LPVOID) (INT_PTR) i, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL );
+		if (ahThreads[ nThreads ]) nThreads++;
+	}
+
+	int errCode = 0;
+	if (! nThreads) {
+		printError( L"Failed to create the reader threads", GetLastError(), 0 );
+		errCode = 7;
+	}
+	else if (! writeEntries()) {
+		printError( L"Failed to write archive", GetLastError(), 0 );
+		tar.bBroken = TRUE;
+		errCode = 7;
+	}
+
+	stopReaders();
+	if (nThreads) WaitForMultipleObjects( nThreads, ahThreads, TRUE, INFINITE );
+	for (int i = 0; i < nThreads; i++) CloseHandle( ahThreads[ i ] );
+
+	DeleteCriticalSection( &tar.lock );
+	for (size_t i = 0; i < tar.nEntries; i++)
+		if (tar.pEntries[ i ].pszLinkName) freeHeap( tar.pEntries[ i ].pszLinkName );
+	for (int i = 0; i < tar.nThreads; i++)
+		for (int j = 0; j < 2; j++)
+			if (tar.pReaders[ i ].buffers[ j ].overlapped.hEvent)
+				CloseHandle( tar.pReaders[ i ].buffers[ j ].overlapped.hEvent );
+	freeHeap( tar.pReaders );
+	tar.pReaders = NULL;
+	VirtualFree( pBuffers, 0, MEM_RELEASE );
+
+	return errCode;
+}
+
+
+//
+// Terminate the archive (two zero blocks) and close it.
+//
+static int closeArchive( void )
+{
+	int errCode = 0;
+	if (! tar.bBroken && (! writeOutput( zeroBlock, BLOCK_SIZE ) ||
+		! writeOutput( zeroBlock, BLOCK_SIZE ) || ! flushOutput())) {
+		printError( L"Failed to write archive", GetLastError(), 0 );
+		errCode = 7;
+	}
+	if (tar.bCloseOutput) CloseHandle( tar.hOutput );
+	tar.hOutput = NULL;
+	tar.nOutput = 0;
+	tar.bBroken = FALSE;
+	return errCode;
+}
+
+
+static int outVerb( wchar_t** argv )
+{
+	if (tar.hOutput) {
+		int errCode = closeArchive();
+		if (errCode) return errCode;
+	}
+
+	if (! wcscmp( argv[ 0 ], L"-" )) {
+		HANDLE hOutput = GetStdHandle( STD_OUTPUT_HANDLE );
+		DWORD dwMode;
+		if (! hOutput || hOutput == INVALID_HANDLE_VALUE ||
+			GetConsoleMode( hOutput, &dwMode )) {
+			printError( L"The archive cannot be written to the console", 0, 0 );
+			return 1;
+		}
+		// The messages already go to standard error output (see
+		// tarWritesStandardOutput)
+		fflush( stdout );
+		tar.hOutput = hOutput;
+		tar.bCloseOutput = FALSE;
+	}
+	else {
+		tar.hOutput = CreateFile( argv[ 0 ], GENERIC_WRITE, FILE_SHARE_READ, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+		if (tar.hOutput == INVALID_HANDLE_VALUE) {
+			tar.hOutput = NULL;
+			printError( L"Failed to create archive", GetLastError(), 0 );
+			return 7;
+		}
+		tar.bCloseOutput = TRUE;
+	}
+
+	return 0;
+}
+
+
+static int checkThreadsVerb( wchar_t** argv )
+{
+	DWORD nThreads;
+	return parseNumberArgument( argv[ 0 ], L"number of threads", 1, MAXIMUM_WAIT_OBJECTS,
+		&nThreads );
+}
+
+
+static int threadsVerb( wchar_t** argv )
+{
+	DWORD nThreads;
+	int errCode = parseNumberArgument( argv[ 0 ], L"number of threads", 1,
+		MAXIMUM_WAIT_OBJECTS, &nThreads );
+	if (! errCode) tar.nThreads = (int) nThreads;
+	return errCode;
+}
+
+
+static int addVerb( wchar_t** argv )
+{
+	if (! tar.hOutput) {
+		printError( L"No archive (use out before add)", 0, 0 );
+		return 1;
+	}
+
+	size_t nPathLen;
+	wchar_t* pwszPath = getLongPath( argv[ 0 ], &nPathLen );
+	if (! pwszPath) {
+		printError( L"Invalid path", GetLastError(), 0 );
+		return 1;
+	}
+
+	if (! tar.nThreads) {
+		// The work is mostly waiting for the disk: a few threads are enough
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo( &systemInfo );
+		tar.nThreads = systemInfo.dwNumberOfProcessors;
+		if (tar.nThreads > 8) tar.nThreads = 8;
+	}
+
+	tar.nEntries = tar.nPathsSize = 0;
+	tar.nBytes = 0;
+	tar.nFiles = tar.nDirectories = tar.nLinks = tar.nErrors = 0;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency( &frequency );
+	QueryPerformanceCounter( &start );
+
+	int errCode = 0;
+	WIN32_FILE_ATTRIBUTE_DATA rootData;
+	if (! GetFileAttributesEx( pwszPath, GetFileExInfoStandard, &rootData )) {
+		printError( L"Failed to open path", GetLastError(), 0 );
+		errCode = 7;
+	}
+	else {
+		// The archived names start with the name of the added path
+		// (nothing for a root directory like C:\)
+		tar.nRootLen = nPathLen;
+		while (tar.nRootLen > 0 && pwszPath[ tar.nRootLen - 1 ] != L'\\') tar.nRootLen--;
+		if (tar.nRootLen < nPathLen)
+			addEntry( pwszPath, nPathLen, rootData.dwFileAttributes, rootData.ftLastWriteTime );
+
+		if (isDirectoryToWalk( rootData.dwFileAttributes )) {
+			// Breadth first: the entries are also the queue of the directories
+			size_t iFirst = tar.nEntries;
+			wchar_t* pwszWorkPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+			enumerateDirectory( pwszPath, nPathLen, pwszWorkPath );
+			for (size_t i = iFirst; i < tar.nEntries; i++)
+				if (isDirectoryToWalk( tar.pEntries[ i ].dwAttributes ))
+					enumerateDirectory( tar.pPaths + tar.pEntries[ i ].nPathOffset,
+						tar.pEntries[ i ].nPathLen, pwszWorkPath );
+			freeHeap( pwszWorkPath );
+		}
+
+		if (tar.nEntries) {
+			OpenThreadToken( GetCurrentThread(), TOKEN_IMPERSONATE | TOKEN_QUERY, TRUE,
+				&tar.hToken );
+			errCode = runReaders();
+			if (tar.hToken) CloseHandle( tar.hToken );
+			tar.hToken = NULL;
+		}
+
+		QueryPerformanceCounter( &end );
+		double dSeconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+		double dMegabytes = tar.nBytes / (1024.0 * 1024.0);
+		printFmtConsoleError(
+			L"%ld files, %ld directories, %ld links, %ld errors, %.1f MB in %.2f s (%.1f MB/s, %d threads)\n",
+			tar.nFiles, tar.nDirectories, tar.nLinks, tar.nErrors, dMegabytes, dSeconds,
+			dSeconds > 0 ? dMegabytes / dSeconds : 0.0, tar.nThreads );
+
+		if (! errCode && tar.nErrors) errCode = 7;
+	}
+
+	freeHeap( pwszPath );
+	return errCode;
+}
+
+
+static const VERB tarVerbs[] = {
+	{ L"out", 1, outVerb },
+	{ L"threads", 1, threadsVerb, checkThreadsVerb },
+	{ L"add", 1, addVerb }
+};
+
+
+//
+// Check whether the archive is written to standard output ("out -"), before
+// anything is logged. The arguments are walked like runVerbs does.
+//
+BOOL tarWritesStandardOutput( int argc, wchar_t** argv )
+{
+	int i = 0;
+	while (i < argc) {
+		const VERB* pVerb = NULL;
+		for (int j = 0; j < sizeof( tarVerbs ) / sizeof( *tarVerbs ); j++)
+			if (! _wcsicmp( argv[ i ], tarVerbs[ j ].pcwszName )) pVerb = &tarVerbs[ j ];
+		if (! pVerb || i + pVerb->nArgs >= argc) break;  // Reported by runVerbs
+		if (pVerb->pfnRun == outVerb && ! wcscmp( argv[ i + 1 ], L"-" )) return TRUE;
+		i += 1 + pVerb->nArgs;
+	}
+	return FALSE;
+}
+
+
+int runTarCommand( int argc, wchar_t** argv )
+{
+	tar.pOutput = allocHeap( 0, OUTPUT_SIZE );
+	tar.pszName = allocHeap( 0, NAME_SIZE );
+	tar.pHeader = allocHeap( 0, HEADER_SIZE );
+
+	int errCode = runVerbs( tarVerbs, sizeof( tarVerbs ) / sizeof( *tarVerbs ), argc, argv );
+	if (tar.hOutput) {
+		// Also after a read failure: the archive is readable up to the last entry
+		int closeErrCode = closeArchive();
+		if (! errCode) errCode = closeErrCode;
+	}
+
+	if (tar.pEntries) freeHeap( tar.pEntries );
+	if (tar.pPaths) freeHeap( tar.pPaths );
+	freeHeap( tar.pOutput );
+	freeHeap( tar.pszName );
+	freeHeap( tar.pHeader );
+	return errCode;
+}
@@ -0,0 +1,14 @@
+#pragma once
+/*
+	superUser 6.0
+
+	Copyright 2019-2025 https://github.com/mspaintmsi/superUser
+
+	tarops.h
+
+	Built-in backup archiver
+
+*/
+
+int runTarCommand( int argc, wchar_t** argv );
+BOOL tarWritesStandardOutput( int argc, wchar_t** argv );
@@ -17,76 +17,232 @@
 #endif
 
 #include "utils.h" // Utility functions
+#include "tokens.h"
+#include "log.h"   // Leveled logging
+#include "retry.h" // Retry of the operations failing with transient errors
 
 #define CUSTOM_ERROR_PROCESS_NOT_FOUND 0xA0001000
 #define CUSTOM_ERROR_SERVICE_START_FAILED 0xA0001001
 
-const wchar_t* apcwszTokenPrivileges[ 36 ] = {
-	SE_ASSIGNPRIMARYTOKEN_NAME,
-	SE_AUDIT_NAME,
-	SE_BACKUP_NAME,
-	SE_CHANGE_NOTIFY_NAME,
-	SE_CREATE_GLOBAL_NAME,
-	SE_CREATE_PAGEFILE_NAME,
-	SE_CREATE_PERMANENT_NAME,
-	SE_CREATE_SYMBOLIC_LINK_NAME,
-	SE_CREATE_TOKEN_NAME, // Most users won't have that.
-	SE_DEBUG_NAME,
-	SE_DELEGATE_SESSION_USER_IMPERSONATE_NAME,
-	SE_ENABLE_DELEGATION_NAME, // Most users won't have that.
-	SE_IMPERSONATE_NAME,
-	SE_INC_BASE_PRIORITY_NAME,
-	SE_INC_WORKING_SET_NAME,
-	SE_INCREASE_QUOTA_NAME,
-	SE_LOAD_DRIVER_NAME,
-	SE_LOCK_MEMORY_NAME,
-	SE_MACHINE_ACCOUNT_NAME, // Most users won't have that.
-	SE_MANAGE_VOLUME_NAME,
-	SE_PROF_SINGLE_PROCESS_NAME,
-	SE_RELABEL_NAME, // Most users won't have that.
-	SE_REMOTE_SHUTDOWN_NAME, // Most users won't have that.
-	SE_RESTORE_NAME,
-	SE_SECURITY_NAME,
-	SE_SHUTDOWN_NAME,
-	SE_SYNC_AGENT_NAME, // Most users won't have that.
-	SE_SYSTEM_ENVIRONMENT_NAME,
-	SE_SYSTEM_PROFILE_NAME,
-	SE_SYSTEMTIME_NAME,
-	SE_TAKE_OWNERSHIP_NAME,
-	SE_TCB_NAME,
-	SE_TIME_ZONE_NAME,
-	SE_TRUSTED_CREDMAN_ACCESS_NAME, // Most users won't have that.
-	SE_UNDOCK_NAME,
-	SE_UNSOLICITED_INPUT_NAME // Most users won't have that.
+// Well-known privilege LUID values (the high part is always 0).
+// They are the same on all Windows versions, so no name lookup is needed.
+#define SE_CREATE_TOKEN_PRIVILEGE 2
+#define SE_ASSIGNPRIMARYTOKEN_PRIVILEGE 3
+#define SE_LOCK_MEMORY_PRIVILEGE 4
+#define SE_INCREASE_QUOTA_PRIVILEGE 5
+#define SE_MACHINE_ACCOUNT_PRIVILEGE 6
+#define SE_TCB_PRIVILEGE 7
+#define SE_SECURITY_PRIVILEGE 8
+#define SE_TAKE_OWNERSHIP_PRIVILEGE 9
+#define SE_LOAD_DRIVER_PRIVILEGE 10
+#define SE_SYSTEM_PROFILE_PRIVILEGE 11
+#define SE_SYSTEMTIME_PRIVILEGE 12
+#define SE_PROF_SINGLE_PROCESS_PRIVILEGE 13
+#define SE_INC_BASE_PRIORITY_PRIVILEGE 14
+#define SE_CREATE_PAGEFILE_PRIVILEGE 15
+#define SE_CREATE_PERMANENT_PRIVILEGE 16
+#define SE_BACKUP_PRIVILEGE 17
+#define SE_RESTORE_PRIVILEGE 18
+#define SE_SHUTDOWN_PRIVILEGE 19
+#define SE_DEBUG_PRIVILEGE 20
+#define SE_AUDIT_PRIVILEGE 21
+#define SE_SYSTEM_ENVIRONMENT_PRIVILEGE 22
+#define SE_CHANGE_NOTIFY_PRIVILEGE 23
+#define SE_REMOTE_SHUTDOWN_PRIVILEGE 24
+#define SE_UNDOCK_PRIVILEGE 25
+#define SE_SYNC_AGENT_PRIVILEGE 26
+#define SE_ENABLE_DELEGATION_PRIVILEGE 27
+#define SE_MANAGE_VOLUME_PRIVILEGE 28
+#define SE_IMPERSONATE_PRIVILEGE 29
+#define SE_CREATE_GLOBAL_PRIVILEGE 30
+#define SE_TRUSTED_CREDMAN_ACCESS_PRIVILEGE 31
+#define SE_RELABEL_PRIVILEGE 32
+#define SE_INC_WORKING_SET_PRIVILEGE 33
+#define SE_TIME_ZONE_PRIVILEGE 34
+#define SE_CREATE_SYMBOLIC_LINK_PRIVILEGE 35
+#define SE_DELEGATE_SESSION_USER_IMPERSONATE_PRIVILEGE 36
+
+#ifndef SE_PRIVILEGE_REMOVED
+#define SE_PRIVILEGE_REMOVED 0x00000004L
+#endif
+
+// SeUnsolicitedInputPrivilege is obsolete: it has no LUID and cannot be set.
+static const struct {
+	const wchar_t* pcwszName;
+	DWORD dwLuid;
+} tokenPrivileges[] = {
+	{ SE_ASSIGNPRIMARYTOKEN_NAME, SE_ASSIGNPRIMARYTOKEN_PRIVILEGE },
+	{ SE_AUDIT_NAME, SE_AUDIT_PRIVILEGE },
+	{ SE_BACKUP_NAME, SE_BACKUP_PRIVILEGE },
+	{ SE_CHANGE_NOTIFY_NAME, SE_CHANGE_NOTIFY_PRIVILEGE },
+	{ SE_CREATE_GLOBAL_NAME, SE_CREATE_GLOBAL_PRIVILEGE },
+	{ SE_CREATE_PAGEFILE_NAME, SE_CREATE_PAGEFILE_PRIVILEGE },
+	{ SE_CREATE_PERMANENT_NAME, SE_CREATE_PERMANENT_PRIVILEGE },
+	{ SE_CREATE_SYMBOLIC_LINK_NAME, SE_CREATE_SYMBOLIC_LINK_PRIVILEGE },
+	{ SE_CREATE_TOKEN_NAME, SE_CREATE_TOKEN_PRIVILEGE }, // Most users won't have that.
+	{ SE_DEBUG_NAME, SE_DEBUG_PRIVILEGE },
+	{ SE_DELEGATE_SESSION_USER_IMPERSONATE_NAME,
+		SE_DELEGATE_SESSION_USER_IMPERSONATE_PRIVILEGE },
+	{ SE_ENABLE_DELEGATION_NAME, SE_ENABLE_DELEGATION_PRIVILEGE }, // Most users won't have that.
+	{ SE_IMPERSONATE_NAME, SE_IMPERSONATE_PRIVILEGE },
+	{ SE_INC_BASE_PRIORITY_NAME, SE_INC_BASE_PRIORITY_PRIVILEGE },
+	{ SE_INC_WORKING_SET_NAME, SE_INC_WORKING_SET_PRIVILEGE },
+	{ SE_INCREASE_QUOTA_NAME, SE_INCREASE_QUOTA_PRIVILEGE },
+	{ SE_LOAD_DRIVER_NAME, SE_LOAD_DRIVER_PRIVILEGE },
+	{ SE_LOCK_MEMORY_NAME, SE_LOCK_MEMORY_PRIVILEGE },
+	{ SE_MACHINE_ACCOUNT_NAME, SE_MACHINE_ACCOUNT_PRIVILEGE }, // Most users won't have that.
+	{ SE_MANAGE_VOLUME_NAME, SE_MANAGE_VOLUME_PRIVILEGE },
+	{ SE_PROF_SINGLE_PROCESS_NAME, SE_PROF_SINGLE_PROCESS_PRIVILEGE },
+	{ SE_RELABEL_NAME, SE_RELABEL_PRIVILEGE }, // Most users won't have that.
+	{ SE_REMOTE_SHUTDOWN_NAME, SE_REMOTE_SHUTDOWN_PRIVILEGE }, // Most users won't have that.
+	{ SE_RESTORE_NAME, SE_RESTORE_PRIVILEGE },
+	{ SE_SECURITY_NAME, SE_SECURITY_PRIVILEGE },
+	{ SE_SHUTDOWN_NAME, SE_SHUTDOWN_PRIVILEGE },
+	{ SE_SYNC_AGENT_NAME, SE_SYNC_AGENT_PRIVILEGE }, // Most users won't have that.
+	{ SE_SYSTEM_ENVIRONMENT_NAME, SE_SYSTEM_ENVIRONMENT_PRIVILEGE },
+	{ SE_SYSTEM_PROFILE_NAME, SE_SYSTEM_PROFILE_PRIVILEGE },
+	{ SE_SYSTEMTIME_NAME, SE_SYSTEMTIME_PRIVILEGE },
+	{ SE_TAKE_OWNERSHIP_NAME, SE_TAKE_OWNERSHIP_PRIVILEGE },
+	{ SE_TCB_NAME, SE_TCB_PRIVILEGE },
+	{ SE_TIME_ZONE_NAME, SE_TIME_ZONE_PRIVILEGE },
+	{ SE_TRUSTED_CREDMAN_ACCESS_NAME, SE_TRUSTED_CREDMAN_ACCESS_PRIVILEGE }, // Most users won't have that.
+	{ SE_UNDOCK_NAME, SE_UNDOCK_PRIVILEGE }
+};
+
+// Privilege profiles (set of privileges enabled in the child process token)
+static const struct {
+	const wchar_t* pcwszName;
+	ULONGLONG privileges;
+} privilegeProfiles[] = {
+	{ L"all", PRIVILEGES_ALL },
+	{ L"backup-restore", PRIVILEGE_BIT( SE_BACKUP_PRIVILEGE ) |
+		PRIVILEGE_BIT( SE_RESTORE_PRIVILEGE ) | PRIVILEGE_BIT( SE_TAKE_OWNERSHIP_PRIVILEGE ) |
+		PRIVILEGE_BIT( SE_SECURITY_PRIVILEGE ) | PRIVILEGE_BIT( SE_CHANGE_NOTIFY_PRIVILEGE ) },
+	{ L"debug", PRIVILEGE_BIT( SE_DEBUG_PRIVILEGE ) |
+		PRIVILEGE_BIT( SE_IMPERSONATE_PRIVILEGE ) | PRIVILEGE_BIT( SE_CHANGE_NOTIFY_PRIVILEGE ) },
+	{ L"minimal", PRIVILEGE_BIT( SE_CHANGE_NOTIFY_PRIVILEGE ) }
 };
 
+// Large enough for all the privileges a token can hold
+typedef struct {
+	DWORD PrivilegeCount;
+	LUID_AND_ATTRIBUTES Privileges[ 64 ];
+} PRIVILEGES_BUFFER;
 
-static BOOL enableTokenPrivilege( HANDLE hToken, const wchar_t* pcwszPrivilege )
-{
-	LUID luid;
-	if (! LookupPrivilegeValue( NULL, pcwszPrivilege, &luid ))
-		return FALSE; // Cannot lookup privilege value
 
+static BOOL enableTokenPrivilege( HANDLE hToken, DWORD dwLuid )
+{
 	TOKEN_PRIVILEGES tp = {
 		.PrivilegeCount = 1,
-		.Privileges[ 0 ].Luid = luid,
+		.Privileges[ 0 ].Luid.LowPart = dwLuid,
 		.Privileges[ 0 ].Attributes = SE_PRIVILEGE_ENABLED
 	};
 
-	AdjustTokenPrivileges( hToken, FALSE, &tp, 0, NULL, NULL );
+	traceCall( AdjustTokenPrivileges, ( hToken, FALSE, &tp, 0, NULL, NULL ) );
 	return (GetLastError() == ERROR_SUCCESS);
 }
 
 
-void setAllPrivileges( HANDLE hToken, BOOL bVerbose )
+//
+// Enable a set of privileges in a token, with a single adjustment.
+// If bRemoveOthers is TRUE, the privileges outside the set are removed from
+// the token.
+//
+void setPrivileges( HANDLE hToken, ULONGLONG privileges, BOOL bRemoveOthers )
+{
+	PRIVILEGES_BUFFER buffer;
+
+	// The privileges held by the token are only needed to remove the others
+	// and to report the missing ones
+	ULONGLONG heldPrivileges = PRIVILEGES_ALL;
+	if (bRemoveOthers || logEnabled( LOG_DEBUG )) {
+		DWORD dwSize;
+		if (traceCall( GetTokenInformation, ( hToken, TokenPrivileges, &buffer,
+			sizeof( buffer ), &dwSize ) )) {
+			heldPrivileges = 0;
+			for (DWORD i = 0; i < buffer.PrivilegeCount; i++) {
+				LUID luid = buffer.Privileges[ i ].Luid;
+				if (! luid.HighPart && luid.LowPart < 64)
+					heldPrivileges |= PRIVILEGE_BIT( luid.LowPart );
+			}
+		}
+	}
+
+	buffer.PrivilegeCount = 0;
+	for (int i = 0; i < sizeof( tokenPrivileges ) / sizeof( *tokenPrivileges ); i++) {
+		ULONGLONG bit = PRIVILEGE_BIT( tokenPrivileges[ i ].dwLuid );
+		DWORD dwAttributes;
+		if (privileges & bit) {
+			if (! (heldPrivileges & bit)) {
+				logDebug( L"Could not set privilege [%ls], you most likely don't have it.",
+					tokenPrivileges[ i ].pcwszName );
+				continue;
+			}
+			dwAttributes = SE_PRIVILEGE_ENABLED;
+		}
+		else if (bRemoveOthers && (heldPrivileges & bit)) dwAttributes = SE_PRIVILEGE_REMOVED;
+		else continue;
+
+		LUID_AND_ATTRIBUTES* pPrivilege = &buffer.Privileges[ buffer.PrivilegeCount++ ];
+		pPrivilege->Luid.LowPart = tokenPrivileges[ i ].dwLuid;
+		pPrivilege->Luid.HighPart = 0;
+		pPrivilege->Attributes = dwAttributes;
+	}
+
+	if (buffer.PrivilegeCount)
+		traceCall( AdjustTokenPrivileges, ( hToken, FALSE, (PTOKEN_PRIVILEGES) &buffer, 0,
+			NULL, NULL ) );
+}
+
+
+void setAllPrivileges( HANDLE hToken )
+{
+	setPrivileges( hToken, PRIVILEGES_ALL, FALSE );
+}
+
+
+//
+// Parse a privilege profile name, or a comma-separated list of privilege
+// names (e.g. "SeBackupPrivilege,Restore").
+//
+int parsePrivilegeProfile( const wchar_t* pcwszProfile, ULONGLONG* pPrivileges )
 {
-	// Iterate over apcwszTokenPrivileges to add all privileges to a token
-	for (int i = 0; i < (sizeof( apcwszTokenPrivileges ) /
-		sizeof( *apcwszTokenPrivileges )); i++)
-		if (! enableTokenPrivilege( hToken, apcwszTokenPrivileges[ i ] ) && bVerbose)
-			printFmtConsole(
-				L"[D] Could not set privilege [%ls], you most likely don't have it.\n",
-				apcwszTokenPrivileges[ i ] );
+	for (int i = 0; i < sizeof( privilegeProfiles ) / sizeof( *privilegeProfiles ); i++)
+		if (! _wcsicmp( pcwszProfile, privilegeProfiles[ i ].pcwszName )) {
+			*pPrivileges = privilegeProfiles[ i ].privileges;
+			return 0;
+		}
+
+	ULONGLONG privileges = 0;
+	const wchar_t* p = pcwszProfile;
+	for (;;) {
+		const wchar_t* pEnd = wcschr( p, L',' );
+		size_t nLength = pEnd ? (size_t) (pEnd - p) : wcslen( p );
+
+		// Full name, or name without the "Se" prefix and "Privilege" suffix
+		int iFound = -1;
+		for (int i = 0; nLength && i < sizeof( tokenPrivileges ) / sizeof( *tokenPrivileges );
+			i++) {
+			const wchar_t* pcwszName = tokenPrivileges[ i ].pcwszName;
+			if ((! _wcsnicmp( pcwszName, p, nLength ) && ! pcwszName[ nLength ]) ||
+				(! _wcsnicmp( pcwszName + 2, p, nLength ) &&
+					! _wcsicmp( pcwszName + 2 + nLength, L"Privilege" ))) {
+				iFound = i;
+				break;
+			}
+		}
+		if (iFound < 0) {
+			printError( L"Invalid privilege profile", 0, 0 );
+			return 1;
+		}
+		privileges |= PRIVILEGE_BIT( tokenPrivileges[ iFound ].dwLuid );
+
+		if (! pEnd) break;
+		p = pEnd + 1;
+	}
+
+	*pPrivileges = privileges;
+	return 0;
 }
 
 
@@ -97,9 +253,10 @@ int acquireSeDebugPrivilege( void )
 
 	BOOL bSuccess = FALSE;
 	HANDLE hToken = NULL;
-	if (OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken )) {
+	if (traceCall( OpenProcessToken, ( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES,
+		&hToken ) )) {
 		iStep++;
-		bSuccess = enableTokenPrivilege( hToken, SE_DEBUG_NAME );
+		bSuccess = enableTokenPrivilege( hToken, SE_DEBUG_PRIVILEGE );
 		if (! bSuccess) dwLastError = GetLastError();
 		CloseHandle( hToken );
 	}
@@ -114,7 +271,7 @@ int acquireSeDebugPrivilege( void )
 }
 
 
-int createSystemContext( void )
+DWORD openSystemToken( HANDLE* phToken, int* piStep )
 {
 	DWORD dwLastError = 0;
 	int iStep = 1;
@@ -124,8 +281,8 @@ int createSystemContext( void )
 	DWORD dwProcCount = 0;
 
 	// Get the process id
-	if (WTSEnumerateProcessesW( WTS_CURRENT_SERVER_HANDLE, 0, 1,
-		&pProcList, &dwProcCount )) {
+	if (traceCall( WTSEnumerateProcessesW, ( WTS_CURRENT_SERVER_HANDLE, 0, 1,
+		&pProcList, &dwProcCount ) )) {
 		PWTS_PROCESS_INFOW pProc = pProcList;
 		while (dwProcCount > 0) {
 			if (! pProc->SessionId && pProc->pProcessName &&
@@ -139,24 +296,26 @@ int createSystemContext( void )
 			dwProcCount--;
 		}
 		WTSFreeMemory( pProcList );
+		if (dwSysPid == (DWORD) -1)
+			dwLastError = CUSTOM_ERROR_PROCESS_NOT_FOUND; // Process not found
 	}
 	else dwLastError = GetLastError();
 
 	HANDLE hToken = NULL;
 
-	if (dwSysPid != (DWORD) -1) {
+	if (! dwLastError) {
 		iStep++;
-		HANDLE hSysProcess = OpenProcess( PROCESS_QUERY_LIMITED_INFORMATION, FALSE,
-			dwSysPid );
+		HANDLE hSysProcess = traceCallHandle( OpenProcess, (
+			PROCESS_QUERY_LIMITED_INFORMATION, FALSE, dwSysPid ) );
 		if (hSysProcess) {
 			iStep++;
 			// Get the process token
 			HANDLE hSysToken = NULL;
-			if (OpenProcessToken( hSysProcess, TOKEN_DUPLICATE, &hSysToken )) {
+			if (traceCall( OpenProcessToken, ( hSysProcess, TOKEN_DUPLICATE, &hSysToken ) )) {
 				iStep++;
-				if (! DuplicateTokenEx( hSysToken,
+				if (! traceCall( DuplicateTokenEx, ( hSysToken,
 					TOKEN_ADJUST_PRIVILEGES | TOKEN_IMPERSONATE, NULL,
-					SecurityImpersonation, TokenImpersonation, &hToken )) {
+					SecurityImpersonation, TokenImpersonation, &hToken ) )) {
 					dwLastError = GetLastError();
 					hToken = NULL;
 				}
@@ -167,20 +326,32 @@ int createSystemContext( void )
 		}
 		else dwLastError = GetLastError();
 	}
-	else dwLastError = CUSTOM_ERROR_PROCESS_NOT_FOUND; // Process not found
 
-	BOOL bSuccess = FALSE;
 	if (hToken) {
 		iStep++;
-		if (enableTokenPrivilege( hToken, SE_ASSIGNPRIMARYTOKEN_NAME )) {
-			iStep++;
-			bSuccess = SetThreadToken( NULL, hToken );
+		if (! enableTokenPrivilege( hToken, SE_ASSIGNPRIMARYTOKEN_PRIVILEGE )) {
+			dwLastError = GetLastError();
+			CloseHandle( hToken );
+			hToken = NULL;
 		}
-		if (! bSuccess) dwLastError = GetLastError();
-		CloseHandle( hToken );
 	}
 
-	if (! bSuccess) {
+	*phToken = hToken;
+	*piStep = iStep;
+	return dwLastError;
+}
+
+
+int getSystemToken( HANDLE* phToken )
+{
+	DWORD dwLastError;
+	int iStep;
+	RETRY_STATE retry;
+	retryBegin( &retry, RETRY_TOKEN );
+	while ((dwLastError = openSystemToken( phToken, &iStep )) &&
+		retryWait( &retry, dwLastError ));
+
+	if (dwLastError) {
 		printError( L"Failed to create system context", dwLastError, iStep );
 		return 5;
 	}
@@ -189,18 +360,39 @@ int createSystemContext( void )
 }
 
 
-int getTrustedInstallerProcess( HANDLE* phTIProcess )
+int createSystemContext( void )
+{
+	HANDLE hToken = NULL;
+	int errCode = getSystemToken( &hToken );
+	if (errCode) return errCode;
+
+	BOOL bSuccess = traceCall( SetThreadToken, ( NULL, hToken ) );
+	DWORD dwLastError = GetLastError();
+	CloseHandle( hToken );
+
+	if (! bSuccess) {
+		printError( L"Failed to create system context", dwLastError, 6 );
+		return 5;
+	}
+
+	return 0;
+}
+
+
+DWORD openTrustedInstallerProcess( HANDLE* phTIProcess, int* piStep )
 {
 	DWORD dwLastError = 0;
 	int iStep = 1;
-	HANDLE hSCManager, hTIService;
+	SC_HANDLE hSCManager, hTIService = NULL;
 	SERVICE_STATUS_PROCESS serviceStatusBuffer = {0};
 
 	SetLastError( 0 );
 
-	hSCManager = OpenSCManager( NULL, NULL, SC_MANAGER_CONNECT );
-	hTIService = OpenService( hSCManager, L"TrustedInstaller",
-		SERVICE_QUERY_STATUS | SERVICE_START );
+	hSCManager = (SC_HANDLE) traceCallHandle( OpenSCManager, ( NULL, NULL,
+		SC_MANAGER_CONNECT ) );
+	if (hSCManager)
+		hTIService = (SC_HANDLE) traceCallHandle( OpenService, ( hSCManager,
+			L"TrustedInstaller", SERVICE_QUERY_STATUS | SERVICE_START ) );
 
 	// Start the TrustedInstaller service
 	BOOL bStopped = TRUE;
@@ -209,15 +401,20 @@ int getTrustedInstallerProcess( HANDLE* phTIProcess )
 		int retry = 1;
 		DWORD dwBytesNeeded;
 		while (
-			QueryServiceStatusEx( hTIService, SC_STATUS_PROCESS_INFO,
+			traceCall( QueryServiceStatusEx, ( hTIService, SC_STATUS_PROCESS_INFO,
 				(LPBYTE) &serviceStatusBuffer, sizeof( SERVICE_STATUS_PROCESS ),
-				&dwBytesNeeded ) &&
+				&dwBytesNeeded ) ) &&
 			(bStopped = (serviceStatusBuffer.dwCurrentState == SERVICE_STOPPED)) &&
 			retry &&
-			StartService( hTIService, 0, NULL )
+			traceCall( StartService, ( hTIService, 0, NULL ) )
 			) {
 			retry = 0;
 		}
+		// The process of a service being stopped is about to exit
+		if (serviceStatusBuffer.dwCurrentState == SERVICE_STOP_PENDING) {
+			bStopped = TRUE;
+			SetLastError( 0 );
+		}
 	}
 
 	if (bStopped) {
@@ -225,20 +422,48 @@ int getTrustedInstallerProcess( HANDLE* phTIProcess )
 		if (dwLastError == 0) dwLastError = CUSTOM_ERROR_SERVICE_START_FAILED;
 	}
 
-	CloseServiceHandle( hSCManager );
-	CloseServiceHandle( hTIService );
-
 	*phTIProcess = NULL;
 
 	if (! bStopped) {
 		iStep++;
 		// Get the TrustedInstaller process handle
-		*phTIProcess = OpenProcess( PROCESS_CREATE_PROCESS | PROCESS_QUERY_INFORMATION,
-			FALSE, serviceStatusBuffer.dwProcessId );
-		if (! *phTIProcess) dwLastError = GetLastError();
+		*phTIProcess = traceCallHandle( OpenProcess, ( PROCESS_CREATE_PROCESS |
+			PROCESS_QUERY_INFORMATION | SYNCHRONIZE, FALSE,
+			serviceStatusBuffer.dwProcessId ) );
+		if (! *phTIProcess) {
+			dwLastError = GetLastError();
+			// The failure is only transient if the process has exited meanwhile:
+			// the service is then stopped or runs another process
+			DWORD dwProcessId = serviceStatusBuffer.dwProcessId;
+			DWORD dwBytesNeeded;
+			if ((dwLastError == ERROR_ACCESS_DENIED || dwLastError == ERROR_INVALID_PARAMETER) &&
+				(! traceCall( QueryServiceStatusEx, ( hTIService, SC_STATUS_PROCESS_INFO,
+					(LPBYTE) &serviceStatusBuffer, sizeof( SERVICE_STATUS_PROCESS ),
+					&dwBytesNeeded ) ) ||
+				serviceStatusBuffer.dwCurrentState != SERVICE_RUNNING ||
+				serviceStatusBuffer.dwProcessId != dwProcessId))
+				dwLastError = CUSTOM_ERROR_SERVICE_START_FAILED;
+		}
 	}
 
-	if (! *phTIProcess) {
+	if (hTIService) CloseServiceHandle( hTIService );
+	if (hSCManager) CloseServiceHandle( hSCManager );
+
+	*piStep = iStep;
+	return dwLastError;
+}
+
+
+int getTrustedInstallerProcess( HANDLE* phTIProcess )
+{
+	DWORD dwLastError;
+	int iStep;
+	RETRY_STATE retry;
+	retryBegin( &retry, RETRY_SERVICE );
+	while ((dwLastError = openTrustedInstallerProcess( phTIProcess, &iStep )) &&
+		retryWait( &retry, dwLastError ));
+
+	if (dwLastError) {
 		printError( L"Failed to open TrustedInstaller process", dwLastError, iStep );
 		return 3;
 	}
@@ -247,7 +472,7 @@ int getTrustedInstallerProcess( HANDLE* phTIProcess )
 }
 
 
-int createChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken )
+DWORD openChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken, int* piStep )
 {
 	DWORD dwLastError = 0;
 	int iStep = 1;
@@ -255,13 +480,13 @@ int createChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken )
 
 	// Get the base process token
 	HANDLE hBaseToken = NULL;
-	if (OpenProcessToken( hBaseProcess, TOKEN_DUPLICATE, &hBaseToken )) {
+	if (traceCall( OpenProcessToken, ( hBaseProcess, TOKEN_DUPLICATE, &hBaseToken ) )) {
 		iStep++;
-		if (! DuplicateTokenEx( hBaseToken,
+		if (! traceCall( DuplicateTokenEx, ( hBaseToken,
 			TOKEN_ADJUST_DEFAULT | TOKEN_ADJUST_PRIVILEGES | TOKEN_ADJUST_SESSIONID |
 			TOKEN_ASSIGN_PRIMARY | TOKEN_QUERY,
 			NULL,
-			SecurityIdentification, TokenPrimary, phNewToken )) {
+			SecurityIdentification, TokenPrimary, phNewToken ) )) {
 			dwLastError = GetLastError();
 			*phNewToken = NULL;
 		}
@@ -269,8 +494,56 @@ int createChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken )
 	}
 	else dwLastError = GetLastError();
 
-	if (! *phNewToken) {
-		printError( L"Failed to create child process token", dwLastError, iStep );
+	*piStep = iStep;
+	return dwLastError;
+}
+
+
+int createTrustedInstallerContext( void )
+{
+	// Impersonate the System user first, then switch the thread
+	// to a duplicate of the TrustedInstaller process token
+	int errCode = createSystemContext();
+	if (errCode) return errCode;
+
+	HANDLE hTIProcess = NULL;
+	errCode = getTrustedInstallerProcess( &hTIProcess );
+	if (errCode) return errCode;
+
+	DWORD dwLastError = 0;
+	int iStep = 1;
+
+	BOOL bSuccess = FALSE;
+	HANDLE hTIToken = NULL;
+	RETRY_STATE retry;
+	retryBegin( &retry, RETRY_TOKEN );
+	retry.hProcess = hTIProcess;
+	while (! traceCall( OpenProcessToken, ( hTIProcess, TOKEN_DUPLICATE, &hTIToken ) )) {
+		hTIToken = NULL;
+		dwLastError = GetLastError();
+		if (! retryWait( &retry, dwLastError )) break;
+	}
+	if (hTIToken) {
+		iStep++;
+		HANDLE hToken = NULL;
+		if (traceCall( DuplicateTokenEx, ( hTIToken,
+			TOKEN_ADJUST_PRIVILEGES | TOKEN_IMPERSONATE | TOKEN_QUERY, NULL,
+			SecurityImpersonation, TokenImpersonation, &hToken ) )) {
+			iStep++;
+			// Built-in commands rely on SeBackup/SeRestore/SeTakeOwnership privileges
+			setAllPrivileges( hToken );
+			bSuccess = traceCall( SetThreadToken, ( NULL, hToken ) );
+			if (! bSuccess) dwLastError = GetLastError();
+			CloseHandle( hToken );
+		}
+		else dwLastError = GetLastError();
+		CloseHandle( hTIToken );
+	}
+
+	CloseHandle( hTIProcess );
+
+	if (! bSuccess) {
+		printError( L"Failed to create TrustedInstaller context", dwLastError, iStep );
 		return 5;
 	}
 
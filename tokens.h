@@ -10,8 +10,21 @@
 
 */
 
+// Set of privileges, as a bit mask indexed by their well-known LUID value
+#define PRIVILEGE_BIT( luid ) ((ULONGLONG) 1 << (luid))
+#define PRIVILEGES_ALL (((ULONGLONG) 1 << 37) - 4)  // LUID values 2 to 36
+
 int acquireSeDebugPrivilege( void );
-int createChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken );
 int createSystemContext( void );
+int createTrustedInstallerContext( void );
+int getSystemToken( HANDLE* phToken );
 int getTrustedInstallerProcess( HANDLE* phTIProcess );
-void setAllPrivileges( HANDLE hToken, BOOL bVerbose );
+int parsePrivilegeProfile( const wchar_t* pcwszProfile, ULONGLONG* pPrivileges );
+void setAllPrivileges( HANDLE hToken );
+void setPrivileges( HANDLE hToken, ULONGLONG privileges, BOOL bRemoveOthers );
+
+// Single attempts, for the callers scheduling their own retries (launch engine).
+// Return 0 or the error of the attempt, and the failed step in *piStep.
+DWORD openChildProcessToken( HANDLE hBaseProcess, HANDLE* phNewToken, int* piStep );
+DWORD openSystemToken( HANDLE* phToken, int* piStep );
+DWORD openTrustedInstallerProcess( HANDLE* phTIProcess, int* piStep );
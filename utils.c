@@ -9,11 +9,26 @@
 
 	- Memory allocation
 	- Console output
+	- Built-in command verbs
+	- Image path resolution
+	- Long paths and directory enumeration
+	- Environment blocks
 
 */
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "log.h"  // Leveled logging
+
+// Windows 7 and later, not declared for Vista targets
+#define FIND_EX_INFO_BASIC ((FINDEX_INFO_LEVELS) 1)
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
 
 
 //
@@ -97,52 +112,279 @@ static BOOL v_printFmtConsoleStream( FILE* stream, const wchar_t* pwszFormat,
 
 
 //
-// Print a formatted string with variable arguments to a stream
+// Print a formatted string with variable arguments to standard output
 // using the current console output code page.
 //
-static BOOL printFmtConsoleStream( FILE* stream, const wchar_t* pwszFormat, ... )
+BOOL printFmtConsole( const wchar_t* pwszFormat, ... )
 {
 	va_list args;
 	va_start( args, pwszFormat );
-	BOOL bResult = v_printFmtConsoleStream( stream, pwszFormat, args );
+	BOOL bResult = v_printFmtConsoleStream( stdout, pwszFormat, args );
 	va_end( args );
 	return bResult;
 }
 
 
 //
-// Print a formatted string with variable arguments to standard output
+// Print a formatted string with variable arguments to standard error output
 // using the current console output code page.
 //
-BOOL printFmtConsole( const wchar_t* pwszFormat, ... )
+BOOL printFmtConsoleError( const wchar_t* pwszFormat, ... )
 {
 	va_list args;
 	va_start( args, pwszFormat );
-	BOOL bResult = v_printFmtConsoleStream( stdout, pwszFormat, args );
+	BOOL bResult = v_printFmtConsoleStream( stderr, pwszFormat, args );
 	va_end( args );
 	return bResult;
 }
 
 
 //
-// Print an error message to standard error output
+// Log an error message (printed to standard error output)
 //
 void printError( const wchar_t* pwszMessage, DWORD dwCode, int iPosition )
 {
-	wchar_t pwszFormat[] = L"[E] %ls (code: 0x%08lX, pos: %d)\n";
-	wchar_t* pEnd = NULL;
-	if (dwCode == 0) {
-		// Remove the error code/position part from the format
-		pEnd = pwszFormat + 7;
+	if (dwCode == 0)
+		logError( L"%ls", pwszMessage );
+	else if (iPosition == 0)
+		logError( L"%ls (code: 0x%08lX)", pwszMessage, dwCode );
+	else
+		logError( L"%ls (code: 0x%08lX, pos: %d)", pwszMessage, dwCode, iPosition );
+}
+
+
+//
+// Find a verb by its name (case-insensitive).
+//
+static const VERB* findVerb( const VERB* pVerbs, int nVerbs, const wchar_t* pwszName )
+{
+	for (int i = 0; i < nVerbs; i++)
+		if (! _wcsicmp( pwszName, pVerbs[ i ].pcwszName )) return &pVerbs[ i ];
+	return NULL;
+}
+
+
+//
+// Run a sequence of verbs with their arguments, stopping at the first failure.
+//
+// The whole sequence is checked before running anything, so that a typo
+// at the end of the line does not leave the operations half done.
+//
+int runVerbs( const VERB* pVerbs, int nVerbs, int argc, wchar_t** argv )
+{
+	if (argc == 0) {
+		printError( L"Missing built-in command verb", 0, 0 );
+		return 1;
+	}
+
+	for (int iPass = 0; iPass < 2; iPass++) {
+		int i = 0;
+		while (i < argc) {
+			const VERB* pVerb = findVerb( pVerbs, nVerbs, argv[ i ] );
+			if (! pVerb || i + pVerb->nArgs >= argc) {
+				logError( L"%ls verb: %ls",
+					pVerb ? L"Missing argument for" : L"Invalid", argv[ i ] );
+				return 1;
+			}
+			int errCode = 0;
+			if (iPass) errCode = pVerb->pfnRun( argv + i + 1 );
+			else if (pVerb->pfnCheck) errCode = pVerb->pfnCheck( argv + i + 1 );
+			if (errCode) return errCode;
+			i += 1 + pVerb->nArgs;
+		}
+	}
+
+	return 0;
+}
+
+
+//
+// Parse the numeric argument of a verb: a decimal number from nMin to nMax.
+// pcwszName names the argument in the error message.
+//
+int parseNumberArgument( const wchar_t* pcwszArgument, const wchar_t* pcwszName,
+	DWORD nMin, DWORD nMax, DWORD* pnValue )
+{
+	wchar_t* pEnd;
+	errno = 0;
+	unsigned long nValue = wcstoul( pcwszArgument, &pEnd, 10 );
+	if (pEnd == pcwszArgument || *pEnd || errno == ERANGE || nValue < nMin ||
+		nValue > nMax) {
+		logError( L"Invalid %ls (%lu-%lu): %ls", pcwszName, nMin, nMax, pcwszArgument );
+		return 1;
+	}
+	*pnValue = nValue;
+	return 0;
+}
+
+
+//
+// Resolve the image file of a command line (its first argument, quoted or
+// not) to a full path. It is searched like CreateProcess does: ".exe" is
+// appended if the name has no extension.
+//
+// Return a buffer allocated from the process heap, or NULL if not found.
+//
+wchar_t* resolveImagePath( const wchar_t* pcwszCommandLine )
+{
+	// Extract the file name
+	const wchar_t* p = pcwszCommandLine;
+	while (*p == L' ' || *p == L'\t') p++;
+	const wchar_t* pBegin;
+	if (*p == L'"') {
+		pBegin = ++p;
+		while (*p && *p != L'"') p++;
+	}
+	else {
+		pBegin = p;
+		while (*p && *p != L' ' && *p != L'\t') p++;
+	}
+
+	size_t nLength = p - pBegin;
+	if (! nLength) {
+		SetLastError( ERROR_FILE_NOT_FOUND );
+		return NULL;
+	}
+	wchar_t* pwszName = allocHeap( 0, (nLength + 1) * sizeof( wchar_t ) );
+	memcpy( pwszName, pBegin, nLength * sizeof( wchar_t ) );
+	pwszName[ nLength ] = 0;
+
+	// Search the file
+	wchar_t* pwszPath = NULL;
+	DWORD nSize = SearchPath( NULL, pwszName, L".exe", 0, NULL, NULL );
+	if (nSize) {
+		pwszPath = allocHeap( 0, nSize * sizeof( wchar_t ) );
+		DWORD nLen = SearchPath( NULL, pwszName, L".exe", nSize, pwszPath, NULL );
+		if (! nLen || nLen >= nSize) {
+			freeHeap( pwszPath );
+			pwszPath = NULL;
+		}
+	}
+
+	freeHeap( pwszName );
+	return pwszPath;
+}
+
+
+//
+// Convert a path to a full path with the "\\?\" prefix, to allow long paths.
+// Return a buffer of MAX_LONG_PATH characters allocated from the process heap,
+// or NULL if the path is invalid.
+//
+wchar_t* getLongPath( const wchar_t* pwszPath, size_t* pnLen )
+{
+	wchar_t* pwszLongPath = allocHeap( 0, MAX_LONG_PATH * sizeof( wchar_t ) );
+	wchar_t* pwszFullPath = pwszLongPath + 4;
+	DWORD nLen = GetFullPathName( pwszPath, MAX_LONG_PATH - 8, pwszFullPath, NULL );
+	if (! nLen || nLen >= MAX_LONG_PATH - 8) {
+		freeHeap( pwszLongPath );
+		return NULL;
 	}
-	else if (iPosition == 0) {
-		// Remove the error position part from the format
-		pEnd = pwszFormat + 22;
-		*pEnd++ = L')';
+
+	if (! wcsncmp( pwszFullPath, L"\\\\?\\", 4 )) {
+		// Already prefixed
+		memmove( pwszLongPath, pwszFullPath, (nLen + 1) * sizeof( wchar_t ) );
+	}
+	else if (! wcsncmp( pwszFullPath, L"\\\\", 2 )) {
+		// UNC path: \\server\share -> \\?\UNC\server\share
+		memmove( pwszLongPath + 8, pwszFullPath + 2, (nLen - 1) * sizeof( wchar_t ) );
+		memcpy( pwszLongPath, L"\\\\?\\UNC\\", 8 * sizeof( wchar_t ) );
+		nLen += 6;
+	}
+	else {
+		memcpy( pwszLongPath, L"\\\\?\\", 4 * sizeof( wchar_t ) );
+		nLen += 4;
 	}
-	if (pEnd) {
-		*pEnd++ = L'\n';
-		*pEnd = L'\0';
+
+	// No trailing separator (except for a root directory like C:\)
+	if (nLen > 7 && pwszLongPath[ nLen - 1 ] == L'\\' && pwszLongPath[ nLen - 2 ] != L':')
+		pwszLongPath[ --nLen ] = L'\0';
+
+	*pnLen = nLen;
+	return pwszLongPath;
+}
+
+
+//
+// Start the enumeration of a directory (the handle is used with FindNextFile).
+//
+HANDLE findFirstEntry( const wchar_t* pwszPattern, WIN32_FIND_DATA* pFindData )
+{
+	static volatile LONG bLegacy = FALSE;
+	if (! bLegacy) {
+		// Without short names, and with large batches of entries per call
+		HANDLE hFind = FindFirstFileEx( pwszPattern, FIND_EX_INFO_BASIC, pFindData,
+			FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH );
+		if (hFind != INVALID_HANDLE_VALUE || GetLastError() != ERROR_INVALID_PARAMETER)
+			return hFind;
+		bLegacy = TRUE;  // Windows Vista
 	}
-	printFmtConsoleStream( stderr, pwszFormat, pwszMessage, dwCode, iPosition );
+	return FindFirstFileEx( pwszPattern, FindExInfoStandard, pFindData,
+		FindExSearchNameMatch, NULL, 0 );
+}
+
+
+//
+// Compare the names of two environment variables ("NAME=VALUE") without regard
+// to case, like the system sorts an environment block.
+//
+static int compareVariables( const void* p1, const void* p2 )
+{
+	const wchar_t* pcwsz1 = *(const wchar_t* const*) p1;
+	const wchar_t* pcwsz2 = *(const wchar_t* const*) p2;
+	// The name of a hidden variable (e.g. "=C:=C:\") begins with '='
+	int nLen1 = (int) wcscspn( pcwsz1 + 1, L"=" ) + 1;
+	int nLen2 = (int) wcscspn( pcwsz2 + 1, L"=" ) + 1;
+	return CompareStringOrdinal( pcwsz1, nLen1, pcwsz2, nLen2, TRUE ) - CSTR_EQUAL;
+}
+
+
+//
+// Build the environment block of a child process: the environment of this
+// process, with variables added, replaced or (if their value is empty)
+// removed. The block is sorted by name.
+//
+wchar_t* buildEnvironmentBlock( wchar_t** ppwszVariables, int nVariables )
+{
+	wchar_t* pwszStrings = GetEnvironmentStrings();
+	if (! pwszStrings) return NULL;
+
+	int nStrings = 0;
+	for (const wchar_t* p = pwszStrings; *p; p += wcslen( p ) + 1) nStrings++;
+
+	const wchar_t** ppcwszEntries = allocHeap( 0,
+		(nStrings + nVariables) * sizeof( wchar_t* ) );
+	int nEntries = 0;
+	for (const wchar_t* p = pwszStrings; *p; p += wcslen( p ) + 1)
+		ppcwszEntries[ nEntries++ ] = p;
+
+	// Apply the changes in order: the last one of a name wins
+	for (int i = 0; i < nVariables; i++) {
+		const wchar_t* pcwszVariable = ppwszVariables[ i ];
+		int j = 0;
+		while (j < nEntries && compareVariables( &ppcwszEntries[ j ], &pcwszVariable )) j++;
+		if (j < nEntries) ppcwszEntries[ j ] = ppcwszEntries[ --nEntries ];
+		if (pcwszVariable[ wcscspn( pcwszVariable, L"=" ) + 1 ])
+			ppcwszEntries[ nEntries++ ] = pcwszVariable;
+	}
+
+	qsort( ppcwszEntries, nEntries, sizeof( wchar_t* ), compareVariables );
+
+	size_t nSize = 1;
+	for (int i = 0; i < nEntries; i++) nSize += wcslen( ppcwszEntries[ i ] ) + 1;
+	if (! nEntries) nSize++;  // An empty block has two terminators
+
+	wchar_t* pwszBlock = allocHeap( 0, nSize * sizeof( wchar_t ) );
+	wchar_t* pDest = pwszBlock;
+	for (int i = 0; i < nEntries; i++) {
+		size_t nLen = wcslen( ppcwszEntries[ i ] ) + 1;
+		memcpy( pDest, ppcwszEntries[ i ], nLen * sizeof( wchar_t ) );
+		pDest += nLen;
+	}
+	*pDest++ = L'\0';
+	if (! nEntries) *pDest = L'\0';
+
+	freeHeap( ppcwszEntries );
+	FreeEnvironmentStrings( pwszStrings );
+	return pwszBlock;
 }
@@ -10,6 +10,10 @@
 
 	- Memory allocation
 	- Console output
+	- Built-in command verbs
+	- Image path resolution
+	- Long paths and directory enumeration
+	- Environment blocks
 
 */
 
@@ -26,5 +30,50 @@ BOOL printConsole( const wchar_t* pwszString );
 // using the current console output code page.
 BOOL printFmtConsole( const wchar_t* pwszFormat, ... );
 
-// Print an error message to standard error output.
+// Print a formatted string with variable arguments to standard error output
+// using the current console output code page.
+BOOL printFmtConsoleError( const wchar_t* pwszFormat, ... );
+
+// Log an error message (printed to standard error output).
 void printError( const wchar_t* pwszMessage, DWORD dwCode, int iPosition );
+
+// Built-in command verb: its name, the number of arguments it takes, the
+// function running it and an optional function checking its arguments
+// (both return 0 on success or a superUser error code).
+typedef struct {
+	const wchar_t* pcwszName;
+	int nArgs;
+	int (*pfnRun)( wchar_t** argv );
+	int (*pfnCheck)( wchar_t** argv );
+} VERB;
+
+// Run a sequence of verbs with their arguments, stopping at the first failure.
+// The whole sequence is checked before the first verb runs.
+int runVerbs( const VERB* pVerbs, int nVerbs, int argc, wchar_t** argv );
+
+// Parse the numeric argument of a verb (decimal, from nMin to nMax).
+// Return 0, or 1 after logging an error naming the argument.
+int parseNumberArgument( const wchar_t* pcwszArgument, const wchar_t* pcwszName,
+	DWORD nMin, DWORD nMax, DWORD* pnValue );
+
+// Resolve the image file of a command line to a full path.
+// Return a buffer allocated from the process heap, or NULL if not found.
+wchar_t* resolveImagePath( const wchar_t* pcwszCommandLine );
+
+// Maximum length of a path with the "\\?\" prefix
+#define MAX_LONG_PATH 32768
+
+// Convert a path to a full path with the "\\?\" prefix, to allow long paths.
+// Return a buffer of MAX_LONG_PATH characters allocated from the process heap
+// (its length in *pnLen), or NULL if the path is invalid.
+wchar_t* getLongPath( const wchar_t* pwszPath, size_t* pnLen );
+
+// Start the enumeration of a directory (FindFirstFileEx), as fast as the system
+// allows. The handle is used with FindNextFile and FindClose.
+HANDLE findFirstEntry( const wchar_t* pwszPattern, WIN32_FIND_DATA* pFindData );
+
+// Build the environment block of a child process from the environment of this
+// process and a list of changes ("NAME=VALUE", or "NAME=" to remove a variable).
+// The block is sorted by name. Return a buffer allocated from the process heap,
+// or NULL if the environment could not be read.
+wchar_t* buildEnvironmentBlock( wchar_t** ppwszVariables, int nVariables );